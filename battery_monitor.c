@@ -7,10 +7,24 @@
 #include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <linux/netlink.h>
 #include <errno.h>
 #include <X11/Xlib.h>
 #include <xine.h>
@@ -36,8 +50,13 @@ const char *arg_win_font;
 const char *arg_shutdown_command;
 int arg_check_period;
 
-const char FILE_INFO[] =	"/proc/acpi/battery/BAT1/info";
-const char FILE_STATE[] =	"/proc/acpi/battery/BAT1/state";
+const char BATTERY_DIR[] =	"/proc/acpi/battery";
+const char SYSFS_PS_DIR[] =	"/sys/class/power_supply";
+const char BATTERY_FALLBACK[] =	"BAT1"; /* assumed when enumeration fails */
+
+#define MAX_BATTERIES		4
+#define BAT_NAME_BUFSIZE	32
+#define BAT_PATH_BUFSIZE	64
 
 #define WIN_XPOS		0
 #define WIN_YPOS		0
@@ -50,23 +69,51 @@ const char FILE_STATE[] =	"/proc/acpi/battery/BAT1/state";
 #define MSG_NOTDET_WARNING	4
 #define MSG_CHST_READ_WARNING	5
 #define	MSG_CHST_UNK_WARNING	6
-#define MSG_REMOVE_SIGN		10
-const char *x11_signs[] = {
-	"Battery charged",
-	"LOW BATTERY!",
-	"Warning: unable to read low capacity limit",
-	"Warning: unable to read remaining capacity",
-	"Warning: battery not detected",
-	"Warning: unable to read charging state",
-	"Warning: unknown charging state",
-	NULL
+#define MSG_REMOVE_SIGN		10 /* remove every sign */
+#define MSG_REMOVE_BASE		16 /* MSG_REMOVE_BASE + sign: remove one sign */
+#define MSG_TEMP_BASE		32 /* MSG_TEMP_BASE + sign: temporal display */
+#define MSG_NUM_SIGNS		7 /* entries in x11_signs below */
+
+/* Sign message with its length fixed at compile time. */
+struct x11_sign_msg {
+	const char *text;
+	size_t length;
+};
+#define X11_SIGN_MSG(s)		{ s, sizeof(s) - 1 }
+
+/* table order must match the MSG_* indices above */
+const struct x11_sign_msg x11_signs[MSG_NUM_SIGNS] = {
+	X11_SIGN_MSG("Battery charged"),			/* MSG_BATTERY_CHARGED */
+	X11_SIGN_MSG("LOW BATTERY!"),				/* MSG_LOW_BATTERY */
+	X11_SIGN_MSG("Warning: unable to read low capacity limit"),	/* MSG_LOWCAP_WARNING */
+	X11_SIGN_MSG("Warning: unable to read remaining capacity"),	/* MSG_REMCAP_WARNING */
+	X11_SIGN_MSG("Warning: battery not detected"),		/* MSG_NOTDET_WARNING */
+	X11_SIGN_MSG("Warning: unable to read charging state"),	/* MSG_CHST_READ_WARNING */
+	X11_SIGN_MSG("Warning: unknown charging state")		/* MSG_CHST_UNK_WARNING */
 };
 
 #define TEMP_SIGN_TIME		5 /* seconds */
 #define CHECK_PERIOD_MIN	1 /* seconds */
 #define CHECK_PERIOD_MAX	(24 * 3600) /* seconds */
 #define CHECK_PERIOD_DEFAULT	20 /* seconds */
+#define CHECK_PERIOD_RELAXED	(5 * 60) /* seconds, for calm states */
 #define SAFETY_TIME		60 /* seconds */
+#define TTE_WARNING_TIME	(15 * 60) /* seconds */
+#define TTE_EWMA_WEIGHT		0.2 /* weight of the newest drain rate sample */
+
+#define WATCHDOG_PERIOD		60 /* seconds between self-samples */
+#define WATCHDOG_FD_BUDGET	64 /* open file descriptors */
+#define WATCHDOG_RSS_BUDGET_KB	(16 * 1024) /* resident set size */
+#define WATCHDOG_THREAD_BUDGET	8 /* live threads */
+
+/* Tunables with compile-time defaults, overridable from the config file. */
+int cfg_safety_time = SAFETY_TIME;
+int cfg_temp_sign_time = TEMP_SIGN_TIME;
+int cfg_tte_warning_time = TTE_WARNING_TIME;
+int cfg_fd_budget = WATCHDOG_FD_BUDGET;
+int cfg_rss_budget_kb = WATCHDOG_RSS_BUDGET_KB;
+int cfg_thread_budget = WATCHDOG_THREAD_BUDGET;
+int cfg_trace = 0;	/* record an acquisition trace for offline replay */
 
 const char SHUTDOWN_WAIT[] =	"2"; /* minutes */
 
@@ -75,9 +122,18 @@ const char SHUTDOWN_WAIT[] =	"2"; /* minutes */
 #define READ_FD			0
 #define WRITE_FD		1
 
+#define UEVENT_BUFSIZE		2048 /* kernel uevent datagram buffer */
+#define INOTIFY_BUFSIZE		2048 /* inotify event drain buffer */
+
+#define EVENT_BUFFER_RECORDS	64 /* pending event log records */
+#define EVENT_FLUSH_PERIOD	60 /* seconds before pending records go out */
+
 /* Boolean type. */
 typedef enum { false = 0, true = 1 } bool;
 
+/* Thread running the main loop. Only it waits on the shared sockets. */
+pthread_t mainloop_thread;
+
 /* Get the "design capacity low" field. Returns -1 in case of problems. */
 int get_design_capacity_low(void);
 
@@ -100,8 +156,9 @@ charging_state get_charging_state(void);
 
 /* Draw sign on screen. */
 void x11_sign_init(void);				/* init sign system */
+void x11_sign_ensure(void);				/* lazy init on first use */
 void x11_sign_display(char sign, bool *ds);		/* display a sign */
-void x11_sign_display_temp(char sign, bool *ds);	/* temporal display */
+void x11_sign_display_temp(char sign);			/* temporal display */
 void x11_sign_undisplay(bool *ds);			/* undisplay it */
 
 /* Play an alert sound. */
@@ -112,6 +169,20 @@ typedef enum {
 } alert_type;
 void emit_alert(alert_type alert);
 void alert_init(void);					/* init alert system */
+void alert_ensure(void);				/* lazy init on first use */
+
+/* Asynchronous command worker. */
+typedef enum {
+	CMD_ALERT
+} async_command_type;
+
+struct async_command {
+	async_command_type type;
+	alert_type alert;	/* for CMD_ALERT */
+};
+
+void async_init(void);					/* init worker thread */
+void async_dispatch(const struct async_command *cmd);	/* queue a command */
 
 /* Start shutdown process. */
 void start_shutdown(bool *already_active);
@@ -119,8 +190,92 @@ void start_shutdown(bool *already_active);
 /* Stop shutdown process. */
 void stop_shutdown(bool *still_active);
 
+/* Spawn engine for the shutdown command. */
+void spawn_init(void);					/* SIGCHLD machinery */
+
+/* Hot-path timing instrumentation. */
+typedef enum {
+	STATS_ACQUIRE = 0,
+	STATS_DECIDE = 1,
+	STATS_PUBLISH = 2,
+	STATS_SLEEP = 3,
+	STATS_NUM_PHASES = 4
+} stats_phase;
+volatile sig_atomic_t stats_dump_requested;		/* set by SIGUSR1 */
+void stats_init(void);					/* SIGUSR1 dump trigger */
+long long stats_now_ns(void);				/* monotonic timestamp */
+long long stats_probe(stats_phase phase, long long phase_start);
+void stats_dump(void);					/* histograms to stderr */
+
 /* Sleep the specified amount of seconds. */
 void safe_sleep(long seconds);
+void sleep_init(void);					/* wake pipe and event set */
+void sleep_interrupt(void);				/* end a sleep early */
+void sleep_watch_fd(int fd);				/* add fd to the event set */
+
+/* Suspend/resume detection. */
+long resume_gap(void);					/* suspended seconds */
+extern bool resume_detected;				/* consumed by main loop */
+
+/* Choose the next check period based on battery dynamics. */
+long next_check_period(charging_state state);
+
+/* Subscribe to kernel battery events. Polling is used as fallback. */
+void acpi_events_init(void);
+
+/* Enumerate available batteries. Does not return if none can be set up. */
+void batteries_init(void);
+
+/* Persistent battery state history ring. */
+void history_init(void);				/* map history file */
+void history_append(charging_state state);		/* record one sample */
+
+/* Crash-safe checkpoint of the main loop decision state. */
+void state_init(void);					/* map the state file */
+void state_restore(int *warnnum, bool *shutdown_launched);
+void state_checkpoint(int warnnum, bool shutdown_launched);
+
+/* Time-to-empty prediction. */
+void prediction_update(charging_state state);		/* feed one sample */
+long prediction_time_to_empty(void);			/* seconds, -1 unknown */
+extern double tte_drain_rate;				/* EWMA of drain rate */
+
+/* Shared-memory metrics segment for external scrapers. */
+void metrics_init(void);				/* map the segment */
+void metrics_publish(charging_state state, int warnnum, bool shutdown_launched);
+
+/* Local query socket for fleet tooling. */
+void query_init(void);					/* create the socket */
+void query_handle(void);				/* answer pending queries */
+int query_oneshot(void);				/* --query mode */
+
+/* Structured binary event log. */
+struct event_record {
+	int id;			/* MSG_* index of the warning */
+	int count;		/* identical consecutive events collapsed */
+	long timestamp;		/* latest occurrence */
+	long value;		/* event-specific detail, 0 when unused */
+};
+void event_init(void);					/* open the log file */
+void event_log(int id, long value);			/* append or collapse */
+void event_flush(void);					/* batch write aged records */
+
+/* Acquisition trace for deterministic offline replay. */
+struct trace_record {
+	long timestamp;		/* acquisition time */
+	int state;		/* charging_state value */
+	int remcap;		/* remaining capacity */
+	int rate;		/* present rate */
+	int lowcap;		/* low capacity limit */
+};
+void trace_capture(charging_state state);		/* record one cycle */
+
+/* Self-monitoring resource watchdog. */
+void watchdog_sample(void);				/* low-frequency check */
+
+/* Optional config file overriding the compiled-in thresholds. */
+void config_init(void);					/* load + inotify watch */
+void config_reload(void);				/* re-read after changes */
 
 /* Parse program arguments. Does not return in case of errors. */
 void parse_args(int argc, char *argv[]);
@@ -131,6 +286,7 @@ void parse_args(int argc, char *argv[]);
  * MAIN PROGRAM
  */
 
+#ifndef BATTERY_MONITOR_BENCH
 int main(int argc, char *argv[])
 {
 	charging_state curstate;	/* current charging state */
@@ -138,25 +294,61 @@ int main(int argc, char *argv[])
 
 	int remcap;			/* remaining capacity */
 	int lowlimit;			/* low capacity limit */
+	long tte;			/* projected time to empty */
 
 	int warnnum;			/* number of warnings so far */
 	bool shutdown_launched;		/* shutdown process running? */
 	bool x11_sign_active;		/* X11 sign active? */
 
+	long long phase_start;		/* phase timing probes */
+
+	/* one-shot query mode for scripts: no X11, no xine, no daemon */
+	if (2 == argc && 0 == strcmp(argv[1], "--query"))
+		return query_oneshot();
+
 	/* initializations */
+	/*
+	 * X11 and xine are expensive to bring up (display connection, font
+	 * load, plugin scan) and many units never show a sign or play an
+	 * alert, so both are initialized lazily on first use and the first
+	 * battery reading happens right away.
+	 */
 	parse_args(argc, argv);
-	x11_sign_init();
-	alert_init();
+	sleep_init();
+	config_init();
+	event_init();
+	spawn_init();
+	stats_init();
+	batteries_init();
+	async_init();
+	acpi_events_init();
+	history_init();
+	state_init();
+	metrics_init();
+	query_init();
+	mainloop_thread = pthread_self();
 	curstate = CHST_INVALID;
 	prevstate = CHST_INVALID;
-	warnnum = 0;
-	shutdown_launched = false;
+	state_restore(&warnnum, &shutdown_launched);
 	x11_sign_active = false;
 
 	/* main loop */
 	for (;;) {
+		/* after a resume the safety-time accounting and the drain
+		 * average describe a battery that no longer exists */
+		if (resume_detected) {
+			resume_detected = false;
+			warnnum = 0;
+			tte_drain_rate = -1.0;
+		}
+
 		/* get chargning state */
+		phase_start = stats_now_ns();
 		curstate = get_charging_state();
+		history_append(curstate);
+		prediction_update(curstate);
+		trace_capture(curstate);
+		phase_start = stats_probe(STATS_ACQUIRE, phase_start);
 
 		/* the big switch: decides what to do based on charging state */
 		switch (curstate) {
@@ -169,23 +361,25 @@ int main(int argc, char *argv[])
 			/* check low limit */
 			lowlimit = get_design_capacity_low();
 			if (-1 == lowlimit) {
-				fprintf(stderr, "%s\n", x11_signs[MSG_LOWCAP_WARNING]);
-				x11_sign_display_temp(MSG_LOWCAP_WARNING, &x11_sign_active);
+				event_log(MSG_LOWCAP_WARNING, 0L);
+				x11_sign_display_temp(MSG_LOWCAP_WARNING);
 				break;
 			}
 
 			/* check remaining capacity */
 			remcap = get_remaining_capacity();
 			if (-1 == remcap) {
-				fprintf(stderr, "%s\n", x11_signs[MSG_REMCAP_WARNING]);
-				x11_sign_display_temp(MSG_REMCAP_WARNING, &x11_sign_active);
+				event_log(MSG_REMCAP_WARNING, 0L);
+				x11_sign_display_temp(MSG_REMCAP_WARNING);
 				break;
 			}
 
-			/* low battery: display sign, alert and/or shutdown */
-			if (remcap < lowlimit) {
+			/* low battery: below the capacity limit, or the
+			 * drain rate projects the pack empty too soon */
+			tte = prediction_time_to_empty();
+			if (remcap < lowlimit || (-1 != tte && tte <= cfg_tte_warning_time)) {
 				x11_sign_display(MSG_LOW_BATTERY, &x11_sign_active);
-				if (warnnum * arg_check_period >= SAFETY_TIME && !shutdown_launched)
+				if (warnnum * arg_check_period >= cfg_safety_time && !shutdown_launched)
 					start_shutdown(&shutdown_launched);
 				else {
 					warnnum++;
@@ -218,7 +412,7 @@ int main(int argc, char *argv[])
 			x11_sign_undisplay(&x11_sign_active);
 			warnnum = 0;
 			stop_shutdown(&shutdown_launched);
-			fprintf(stderr, "%s\n", x11_signs[MSG_NOTDET_WARNING]);
+			event_log(MSG_NOTDET_WARNING, 0L);
 			break;
 
 		case CHST_INVALID:
@@ -226,14 +420,14 @@ int main(int argc, char *argv[])
 			x11_sign_undisplay(&x11_sign_active);
 			warnnum = 0;
 			stop_shutdown(&shutdown_launched);
-			fprintf(stderr, "%s\n", x11_signs[MSG_CHST_READ_WARNING]);
-			x11_sign_display_temp(MSG_CHST_READ_WARNING, &x11_sign_active);
+			event_log(MSG_CHST_READ_WARNING, 0L);
+			x11_sign_display_temp(MSG_CHST_READ_WARNING);
 			break;
 
 		case CHST_OTHER:
 			/* What? */
-			fprintf(stderr, "%s\n", x11_signs[MSG_CHST_UNK_WARNING]);
-			x11_sign_display_temp(MSG_CHST_UNK_WARNING, &x11_sign_active);
+			event_log(MSG_CHST_UNK_WARNING, 0L);
+			x11_sign_display_temp(MSG_CHST_UNK_WARNING);
 			break;
 
 		default:
@@ -242,13 +436,28 @@ int main(int argc, char *argv[])
 
 		}
 
-		/* save previous state and sleep */
+		phase_start = stats_probe(STATS_DECIDE, phase_start);
+
+		/* publish state, save previous state and sleep */
+		watchdog_sample();
+		event_flush();
+		state_checkpoint(warnnum, shutdown_launched);
+		metrics_publish(curstate, warnnum, shutdown_launched);
+		phase_start = stats_probe(STATS_PUBLISH, phase_start);
 		prevstate = curstate;
-		safe_sleep(arg_check_period);
+		safe_sleep(next_check_period(curstate));
+		stats_probe(STATS_SLEEP, phase_start);
+
+		/* dump timing histograms when SIGUSR1 asked for them */
+		if (stats_dump_requested) {
+			stats_dump_requested = 0;
+			stats_dump();
+		}
 	}
 
 	return EXIT_FAILURE;	/* unreachable */
 }
+#endif /* BATTERY_MONITOR_BENCH */
 
 
 
@@ -256,602 +465,2399 @@ int main(int argc, char *argv[])
  * FUNCTION IMPLEMENTATIONS
  */
 
-/* Auxiliar function. Read an integer field in a file. Returns -1 on errors. */
-int get_integer_field(const char filename[], const char giveaway[], const char sscanfpattern[])
-{
-	char line[LINE_BUFSIZE];
-	int fieldval = -1;
+/* Battery data snapshot, filled in a single pass over each data file. */
+struct battery_snapshot {
+	bool present;		/* battery present */
+	charging_state state;	/* charging state */
+	int remcap;		/* remaining capacity */
+	int rate;		/* present rate */
+	int lowcap;		/* design capacity low */
+	time_t timestamp;	/* time of last refresh, 0 if never filled */
+};
 
-	FILE *info = fopen(filename, "r");
-	if (NULL == info)
-		return -1;
+/* Acquisition backend for one battery. */
+typedef enum {
+	BACKEND_PROC,	/* legacy /proc/acpi/battery, parsed per cycle */
+	BACKEND_SYSFS	/* /sys/class/power_supply, pread on cached fds */
+} battery_backend;
 
-	while (NULL != fgets(line, LINE_BUFSIZE, info)) {
-		/* check line start */
-		if (line == strstr(line, giveaway)) {
-			if (sscanf(line, sscanfpattern, &fieldval) < 1)
-				fieldval = -1;
-			break;
-		}
-	}
+/* Fields the /proc parsers care about. PF_NONE marks uninteresting lines. */
+typedef enum {
+	PF_NONE = 0,
+	PF_PRESENT,
+	PF_STATE,
+	PF_RATE,
+	PF_REMCAP,
+	PF_LOWCAP
+} proc_field;
 
-	fclose(info);
-	return fieldval;
-}
+#define PROC_MAX_LINES		24 /* enough for both /proc battery files */
 
-int get_design_capacity_low(void)
-{
-	static const char lowcapgiveaway[] = "design capacity low:";
-	static const char lowcapvalpattern[] = "%*s%*s%*s%d%*s\n";
-	return get_integer_field(FILE_INFO, lowcapgiveaway, lowcapvalpattern);
-}
+/*
+ * Learned layout of one /proc battery file. The format is rigidly
+ * column-aligned and never changes after boot, so the first (slow) parse
+ * records which line holds which field and where its value starts; later
+ * reads jump straight there, validating only the field prefix.
+ */
+struct proc_layout {
+	bool learned;			/* fast path usable */
+	int num_lines;
+	char field[PROC_MAX_LINES];	/* proc_field of each line */
+	unsigned char offset[PROC_MAX_LINES];	/* value offset in the line */
+};
 
-int get_present_rate(void)
-{
-	static const char currategiveaway[] = "present rate:";
-	static const char curratepattern[] = "%*s%*s%d%*s\n";
-	return get_integer_field(FILE_STATE, currategiveaway, curratepattern);
-}
+/* One monitored battery: data sources plus its latest snapshot. */
+struct battery {
+	char name[BAT_NAME_BUFSIZE];
+	battery_backend backend;
 
-int get_remaining_capacity(void)
-{
-	static const char remcapgiveaway[] = "remaining capacity:";
-	static const char remcappattern[] = "%*s%*s%d%*s\n";
-	return get_integer_field(FILE_STATE, remcapgiveaway, remcappattern);
-}
+	/* BACKEND_PROC data file paths */
+	char info_path[BAT_PATH_BUFSIZE];
+	char state_path[BAT_PATH_BUFSIZE];
 
-/* Auxiliar function. Read a string field in a file. Returns -1 on errors. */
-int get_string_field(const char filename[], const char giveaway[], const char sscanfpattern[], char field[LINE_BUFSIZE])
-{
-	char line[LINE_BUFSIZE];
-	int retstate = -1;
+	/* BACKEND_SYSFS attribute fds, opened once, -1 when absent */
+	int fd_present;
+	int fd_status;
+	int fd_charge;
+	int fd_rate;
+	int fd_lowcap;
+	bool lowcap_design;	/* fd_lowcap holds the design capacity */
 
-	FILE *info = fopen(filename, "r");
-	if (NULL == info)
-		return -1;
+	/* BACKEND_PROC learned file layouts */
+	struct proc_layout info_layout;
+	struct proc_layout state_layout;
 
-	while (NULL != fgets(line, LINE_BUFSIZE, info)) {
-		/* check line start */
-		if (line == strstr(line, giveaway)) {
-			if (sscanf(line, sscanfpattern, field) < 1)
-				retstate = -1;
-			else
-				retstate = 0;
-			break;
-		}
-	}
+	struct battery_snapshot snap;
+};
 
-	fclose(info);
-	return retstate;
-}
+/* monitored batteries, enumerated at startup */
+struct battery batteries[MAX_BATTERIES];
+int num_batteries = 0;
+time_t snapshot_timestamp = 0;	/* time of last batched refresh */
 
-bool get_present(void)
-{
-	static const char psgiveaway[] = "present:";
-	static const char pspattern[] = "%*s%s\n";
+#define SNAPSHOT_MAX_AGE	1 /* seconds */
 
-	char present[LINE_BUFSIZE];
+/* Auxiliar function. Register one legacy /proc battery by name. */
+void battery_add_proc(const char name[])
+{
+	struct battery *bat = &batteries[num_batteries];
+
+	assert(num_batteries < MAX_BATTERIES);
+	assert(strlen(name) < BAT_NAME_BUFSIZE);
+
+	strcpy(bat->name, name);
+	bat->backend = BACKEND_PROC;
+	sprintf(bat->info_path, "%s/%s/info", BATTERY_DIR, name);
+	sprintf(bat->state_path, "%s/%s/state", BATTERY_DIR, name);
+	bat->fd_present = -1;
+	bat->fd_status = -1;
+	bat->fd_charge = -1;
+	bat->fd_rate = -1;
+	bat->fd_lowcap = -1;
+	bat->lowcap_design = false;
+	bat->info_layout.learned = false;
+	bat->state_layout.learned = false;
+	bat->snap.timestamp = 0;
+	num_batteries++;
+}
 
-	if (-1 == get_string_field(FILE_STATE, psgiveaway, pspattern, present))
-		return false;
+/* Auxiliar function. Open one sysfs attribute file. Returns -1 if absent. */
+int sysfs_open_attr(const char name[], const char attr[])
+{
+	char path[BAT_PATH_BUFSIZE * 2];
 
-	if (strcmp(present, "yes") == 0)
-		return true;
-	return false;
+	sprintf(path, "%s/%s/%s", SYSFS_PS_DIR, name, attr);
+	return open(path, O_RDONLY);
 }
 
-charging_state get_charging_state(void)
+/* Auxiliar function. Read a whole attribute with pread. Returns -1 on errors. */
+ssize_t sysfs_read_attr(int fd, char buf[], size_t bufsize)
 {
-	static const char csgiveaway[] = "charging state:";
-	static const char cspattern[] = "%*s%*s%s\n";
+	ssize_t len;
 
-	char state[LINE_BUFSIZE];
+	if (-1 == fd)
+		return -1;
 
-	if (! get_present())
-		return CHST_NO_BAT;
+	do
+		len = pread(fd, buf, bufsize - 1, 0);
+	while (-1 == len && EINTR == errno);
 
-	if (-1 == get_string_field(FILE_STATE, csgiveaway, cspattern, state))
-		return CHST_INVALID;
+	if (len <= 0)
+		return -1;
 
-	if (strcmp(state, "charging") == 0)
-		return CHST_CHARGING;
-	if (strcmp(state, "charged") == 0)
-		return CHST_CHARGED;
-	if (strcmp(state, "discharging") == 0)
-		return CHST_DISCHARGING;
-	return CHST_OTHER;
+	buf[len] = '\0';
+	return len;
 }
 
-/* Auxiliar function. Create a thread in detached mode. */
-int pthread_create_dt(pthread_t *th, void *(*rout)(void *), void *arg)
+/* Auxiliar function. Read an integer attribute. Returns -1 on errors. */
+long sysfs_read_int(int fd)
 {
-	int retval;
-	pthread_attr_t at;
+	char buf[LINE_BUFSIZE];
 
-	assert(0 == pthread_attr_init(&at));
-	assert(0 == pthread_attr_setdetachstate(&at, PTHREAD_CREATE_DETACHED));
-	retval = pthread_create(th, &at, rout, arg);
-	assert(0 == pthread_attr_destroy(&at));
+	if (-1 == sysfs_read_attr(fd, buf, sizeof(buf)))
+		return -1;
 
-	return retval;
+	return strtol(buf, NULL, 10);
 }
 
-/* drawing data needed for any thread that handles signs */
-struct drawing_data {
-	Display *display;
-	Window win;
-	GC context;
-	int xpos;
-	int ypos;
-	XFontStruct *font;
-	const char *cur_msg;
-	size_t cur_msg_len;
-};
-
-/* global drawing data */
-struct drawing_data x11_dd;
-
-/* pipe to communicate with sign control routine */
-int x11_pipe[2];
-
-/* auxiliar function to send a command to the x11 sign routine */
-void x11_send_command(char command)
+/* Auxiliar function. Register one sysfs battery, opening its fds once. */
+void battery_add_sysfs(const char name[])
 {
-	int retval;
-	for (;;) {
-		retval = write(x11_pipe[WRITE_FD], &command, sizeof(char));
-		if (retval == 0)
-			continue;
-		if (retval == -1 && errno == EINTR)
-			continue;
-		assert(retval != -1);
-		break;
+	struct battery *bat = &batteries[num_batteries];
+
+	assert(num_batteries < MAX_BATTERIES);
+	assert(strlen(name) < BAT_NAME_BUFSIZE);
+
+	strcpy(bat->name, name);
+	bat->backend = BACKEND_SYSFS;
+	bat->info_path[0] = '\0';
+	bat->state_path[0] = '\0';
+
+	bat->fd_present = sysfs_open_attr(name, "present");
+	bat->fd_status = sysfs_open_attr(name, "status");
+
+	/* charge-based packs report µAh, energy-based packs µWh */
+	bat->fd_charge = sysfs_open_attr(name, "charge_now");
+	if (-1 == bat->fd_charge)
+		bat->fd_charge = sysfs_open_attr(name, "energy_now");
+
+	bat->fd_rate = sysfs_open_attr(name, "current_now");
+	if (-1 == bat->fd_rate)
+		bat->fd_rate = sysfs_open_attr(name, "power_now");
+
+	/* the alarm attribute matches "design capacity low" when set */
+	bat->lowcap_design = false;
+	bat->fd_lowcap = sysfs_open_attr(name, "alarm");
+	if (-1 == bat->fd_lowcap || sysfs_read_int(bat->fd_lowcap) <= 0) {
+		if (-1 != bat->fd_lowcap)
+			assert(0 == close(bat->fd_lowcap));
+		bat->fd_lowcap = sysfs_open_attr(name, "charge_full_design");
+		if (-1 == bat->fd_lowcap)
+			bat->fd_lowcap = sysfs_open_attr(name, "energy_full_design");
+		bat->lowcap_design = true;
 	}
+
+	bat->snap.timestamp = 0;
+	num_batteries++;
 }
 
-/* auxiliar function to prepare a window for different signs */
-void x11_prepare_sign(char command)
+/* Auxiliar function. True if a sysfs power supply entry is a battery. */
+bool sysfs_is_battery(const char name[])
 {
-	unsigned width;
-	unsigned height;
+	char buf[LINE_BUFSIZE];
+	ssize_t len;
+	int fd;
 
-	x11_dd.cur_msg = x11_signs[(int)command];
-	x11_dd.cur_msg_len = strlen(x11_dd.cur_msg);
-	XUnmapWindow(x11_dd.display, x11_dd.win);
+	fd = sysfs_open_attr(name, "type");
+	if (-1 == fd)
+		return false;
 
-	width = XTextWidth(x11_dd.font, x11_dd.cur_msg, x11_dd.cur_msg_len) + WIN_PADDING + WIN_PADDING;
-	height = x11_dd.ypos + x11_dd.font->descent + WIN_PADDING;
+	len = sysfs_read_attr(fd, buf, sizeof(buf));
+	assert(0 == close(fd));
+	if (-1 == len)
+		return false;
 
-	XResizeWindow(x11_dd.display, x11_dd.win, width, height);
-	XMapWindow(x11_dd.display, x11_dd.win);
-	XDrawString(x11_dd.display, x11_dd.win, x11_dd.context, x11_dd.xpos, x11_dd.ypos, x11_dd.cur_msg, x11_dd.cur_msg_len);
+	return (buf == strstr(buf, "Battery"));
 }
 
-/* sign control routine, receives commands and responds to events */
-void *x11_sign_control_routine(void *unused)
+void batteries_init(void)
 {
-	int connection;
-	int maxfd;
-	fd_set readfds;
-	int retval;
-	char command;
-	XEvent ev;
-
-	connection = ConnectionNumber(x11_dd.display);
-	maxfd = (connection > x11_pipe[READ_FD])? connection : x11_pipe[READ_FD];
-
-	for (;;) {
-		/* prepare select */
-		FD_ZERO(&readfds);
-		FD_SET(connection, &readfds);
-		FD_SET(x11_pipe[READ_FD], &readfds);
-
-		/* do select */
-		while (-1 == (retval = select(maxfd + 1, &readfds, NULL, NULL, NULL)) && errno == EINTR)
-			;
-		assert(retval != -1);
-
-		/* check commands */
-		if (FD_ISSET(x11_pipe[READ_FD], &readfds)) {
-			assert(0 != read(x11_pipe[READ_FD], &command, sizeof(char)));
-
-			switch (command) {
-			case MSG_BATTERY_CHARGED:
-			case MSG_LOW_BATTERY:
-			case MSG_LOWCAP_WARNING:
-			case MSG_REMCAP_WARNING:
-			case MSG_NOTDET_WARNING:
-			case MSG_CHST_READ_WARNING:
-			case MSG_CHST_UNK_WARNING:
-				x11_prepare_sign(command);
-				XFlush(x11_dd.display);
-				break;
-			case MSG_REMOVE_SIGN:
-				XUnmapWindow(x11_dd.display, x11_dd.win);
-				XFlush(x11_dd.display);
-				break;
-			default:
-				assert(false);
-				break;
-			}
+	DIR *dir;
+	struct dirent *entry;
+
+	/* prefer the native sysfs power supply class */
+	dir = opendir(SYSFS_PS_DIR);
+	if (NULL != dir) {
+		while (num_batteries < MAX_BATTERIES && NULL != (entry = readdir(dir))) {
+			if ('.' == entry->d_name[0])
+				continue;
+			if (strlen(entry->d_name) >= BAT_NAME_BUFSIZE)
+				continue;
+			if (! sysfs_is_battery(entry->d_name))
+				continue;
+			battery_add_sysfs(entry->d_name);
 		}
+		assert(0 == closedir(dir));
+	}
+	if (0 != num_batteries)
+		return;
 
-		/* check X11 events */
-		if (FD_ISSET(connection, &readfds)) {
-			if (XPending(x11_dd.display) == 0) {
-				fprintf(stderr, "Warning: activity in X11 connection but no events\n");
+	/* then the legacy /proc interface */
+	dir = opendir(BATTERY_DIR);
+	if (NULL != dir) {
+		while (num_batteries < MAX_BATTERIES && NULL != (entry = readdir(dir))) {
+			if ('.' == entry->d_name[0])
 				continue;
-			}
-
-			XNextEvent(x11_dd.display, &ev);
-			switch (ev.type) {
-			case Expose:
-				if (ev.xexpose.count != 0)
-					break;
-			case VisibilityNotify:
-			case MapNotify:
-				XDrawString(x11_dd.display, x11_dd.win, x11_dd.context, x11_dd.xpos, x11_dd.ypos, x11_dd.cur_msg, x11_dd.cur_msg_len);
-				XFlush(x11_dd.display);
-				break;
-			default:
-				break;
-			}
+			if (strlen(entry->d_name) >= BAT_NAME_BUFSIZE)
+				continue;
+			battery_add_proc(entry->d_name);
 		}
+		assert(0 == closedir(dir));
 	}
 
-	return NULL; /* unreachable */
+	/* fall back to the classic single-battery layout */
+	if (0 == num_batteries) {
+		fprintf(stderr, "Warning: no batteries enumerated, assuming %s\n", BATTERY_FALLBACK);
+		battery_add_proc(BATTERY_FALLBACK);
+	}
 }
 
-void x11_sign_init(void)
-{
-	/* prepare drawing data */
-	pthread_t control_thread;
-	int screen;
-	Colormap cmap;
-	XColor color;
-	unsigned long color_background;
-	unsigned long color_foreground;
-	XSetWindowAttributes attr;
-
-	/* prepare X11 for multithreading */
-	assert(XInitThreads());
-
-	/* prepare sign control pipe */
-	assert(0 == pipe(x11_pipe));
-
-	/* open display */
-	x11_dd.display = NULL;
-	x11_dd.display = XOpenDisplay(NULL);
-	assert (NULL != x11_dd.display);
+/* /proc line giveaways, indexed by proc_field */
+struct proc_giveaway {
+	const char *text;
+	size_t length;
+};
+#define PROC_GIVEAWAY(s)	{ s, sizeof(s) - 1 }
+
+const struct proc_giveaway proc_giveaways[] = {
+	{ NULL, 0 },				/* PF_NONE */
+	PROC_GIVEAWAY("present:"),		/* PF_PRESENT */
+	PROC_GIVEAWAY("charging state:"),	/* PF_STATE */
+	PROC_GIVEAWAY("present rate:"),		/* PF_RATE */
+	PROC_GIVEAWAY("remaining capacity:"),	/* PF_REMCAP */
+	PROC_GIVEAWAY("design capacity low:")	/* PF_LOWCAP */
+};
 
-	/* get default screen */
-	screen = DefaultScreen(x11_dd.display);
+/* Auxiliar function. Hand-rolled scan of a non-negative integer. */
+int proc_scan_int(const char line[], int offset)
+{
+	const char *scan = line + offset;
+	bool digits = false;
+	int value = 0;
+
+	while (' ' == *scan || '\t' == *scan)
+		++scan;
+	while (*scan >= '0' && *scan <= '9') {
+		value = value * 10 + (*scan - '0');
+		digits = true;
+		++scan;
+	}
 
-	/* get colors */
-	cmap = DefaultColormap(x11_dd.display, screen);
-	assert(0 != XAllocNamedColor(x11_dd.display, cmap, "red", &color, &color));
-	color_background = color.pixel;
-	assert(0 != XAllocNamedColor(x11_dd.display, cmap, "white", &color, &color));
-	color_foreground = color.pixel;
+	return digits? value : -1;
+}
 
-	/* get a font for the text */
-	x11_dd.font = XLoadQueryFont(x11_dd.display, arg_win_font);
-	assert (NULL != x11_dd.font);
+/* Auxiliar function. Copies the whitespace-delimited token at the offset. */
+void proc_scan_token(const char line[], int offset, char token[])
+{
+	const char *scan = line + offset;
+	int used = 0;
+
+	while (' ' == *scan || '\t' == *scan)
+		++scan;
+	while ('\0' != *scan && '\n' != *scan &&
+	       ' ' != *scan && '\t' != *scan && used < LINE_MAX)
+		token[used++] = *scan++;
+	token[used] = '\0';
+}
 
-	/* create window */
-	x11_dd.xpos = WIN_PADDING;
-	x11_dd.ypos = x11_dd.font->ascent + WIN_PADDING;
-	attr.background_pixel = color_background;
-	attr.override_redirect = True;
+/* Auxiliar function. Extracts one known field value from its line. */
+void proc_extract(const char line[], proc_field field, int offset,
+		  struct battery_snapshot *snap)
+{
+	char token[LINE_BUFSIZE];
 
-	x11_dd.win = XCreateWindow(x11_dd.display, RootWindow(x11_dd.display, screen), WIN_XPOS, WIN_YPOS, WIN_PADDING, WIN_PADDING, 0, CopyFromParent, InputOutput, CopyFromParent, CWOverrideRedirect | CWBackPixel, &attr);
+	switch (field) {
 
-	switch (x11_dd.win) {
-	case BadAlloc:
-	case BadColor:
-	case BadCursor:
-	case BadMatch:
-	case BadPixmap:
-	case BadValue:
-	case BadWindow:
-		assert(false); /* internal error !!! */
-		break;
-	default:
+	case PF_PRESENT:
+		proc_scan_token(line, offset, token);
+		snap->present = (0 == strcmp(token, "yes"));
 		break;
-	}
 
-	/* select window events to receive */
-	assert(BadWindow != XSelectInput(x11_dd.display, x11_dd.win, StructureNotifyMask | ExposureMask | VisibilityChangeMask));
+	case PF_STATE:
+		proc_scan_token(line, offset, token);
+		if ('\0' == token[0])
+			snap->state = CHST_INVALID;
+		else if (0 == strcmp(token, "charging"))
+			snap->state = CHST_CHARGING;
+		else if (0 == strcmp(token, "charged"))
+			snap->state = CHST_CHARGED;
+		else if (0 == strcmp(token, "discharging"))
+			snap->state = CHST_DISCHARGING;
+		else
+			snap->state = CHST_OTHER;
+		break;
 
-	/* create graphical context */
-	x11_dd.context = XCreateGC(x11_dd.display, x11_dd.win, 0UL, NULL);
+	case PF_RATE:
+		snap->rate = proc_scan_int(line, offset);
+		break;
 
-	switch (XSetForeground(x11_dd.display, x11_dd.context, color_foreground)) {
-	case BadAlloc:
-	case BadGC:
-	case BadValue:
-		assert(false); /* internal error !!! */
+	case PF_REMCAP:
+		snap->remcap = proc_scan_int(line, offset);
 		break;
-	default:
+
+	case PF_LOWCAP:
+		snap->lowcap = proc_scan_int(line, offset);
 		break;
-	}
 
-	switch (XSetBackground(x11_dd.display, x11_dd.context, color_background)) {
-	case BadAlloc:
-	case BadGC:
-	case BadValue:
-		assert(false); /* internal error !!! */
+	case PF_NONE:
 		break;
+
 	default:
+		assert(false);	/* internal error !!! */
 		break;
+
 	}
+}
 
-	switch (XSetFont(x11_dd.display, x11_dd.context, x11_dd.font->fid)) {
-	case BadAlloc:
-	case BadGC:
-	case BadFont:
-		assert(false); /* internal error !!! */
-		break;
-	default:
-		break;
+/* Auxiliar function. Slow path for one line: identify the field by its
+ * giveaway, record the layout for the fast path and extract the value. */
+void proc_learn_line(const char line[], int lineno, proc_field first,
+		     proc_field last, struct proc_layout *layout,
+		     struct battery_snapshot *snap)
+{
+	proc_field field;
+	proc_field candidate;
+	int offset;
+
+	field = PF_NONE;
+	for (candidate = first; candidate <= last; candidate++)
+		if (line == strstr(line, proc_giveaways[candidate].text)) {
+			field = candidate;
+			break;
+		}
+
+	/* learn where the value starts; the format is column-aligned */
+	offset = (int) proc_giveaways[field].length;
+	while (' ' == line[offset] || '\t' == line[offset])
+		++offset;
+	if (lineno < PROC_MAX_LINES) {
+		layout->field[lineno] = (char) field;
+		layout->offset[lineno] = (unsigned char) offset;
 	}
 
-	x11_dd.cur_msg = "";
-	pthread_create_dt(&control_thread, x11_sign_control_routine, NULL);
+	proc_extract(line, field, offset, snap);
 }
 
-void x11_sign_display(char sign, bool *sign_up)
+/* Auxiliar function. Fast path for one line: validate the learned field
+ * prefix and jump straight to its value. False when the layout moved. */
+bool proc_fast_line(const char line[], int lineno,
+		    const struct proc_layout *layout,
+		    struct battery_snapshot *snap)
 {
-	static char cur_sign = '\0';
+	proc_field field;
 
-	if (*sign_up && sign == cur_sign)
-		return;
+	if (lineno >= layout->num_lines)
+		return false;
 
-	if (*sign_up)
-		x11_sign_undisplay(sign_up);
+	field = (proc_field) layout->field[lineno];
+	if (PF_NONE == field) {
+		proc_extract(line, field, 0, snap);
+		return true;
+	}
+	if (0 != strncmp(line, proc_giveaways[field].text,
+			 proc_giveaways[field].length))
+		return false;
 
-	x11_send_command(sign);
-	*sign_up = true;
-	cur_sign = sign;
+	proc_extract(line, field, layout->offset[lineno], snap);
+	return true;
 }
 
-/* Auxiliar struct to store arguments for temporal display sign thread */
-struct temp_sign_args {
-	char sign;
-	bool *sign_active;
-};
-
-/* Temporal display sign thread routine */
-void *x11_temp_sign_control(void *param)
+/* Auxiliar function. Parse one /proc battery file looking for the fields
+ * in the [first, last] proc_field range, learning its layout on the way. */
+void proc_parse_file(const char path[], proc_field first, proc_field last,
+		     struct proc_layout *layout, struct battery_snapshot *snap)
 {
-	struct temp_sign_args args;
+	char line[LINE_BUFSIZE];
+	FILE *file;
+	int lineno;
+	bool fast;
+
+	file = fopen(path, "r");
+	if (NULL == file)
+		return;
 
-	/* recover args */
-	assert(NULL != param);
-	args = *((struct temp_sign_args *)param);
+	fast = layout->learned;
+	lineno = 0;
+	while (NULL != fgets(line, LINE_BUFSIZE, file)) {
+		if (fast) {
+			if (! proc_fast_line(line, lineno, layout, snap)) {
+				/* layout changed: relearn from the top */
+				layout->learned = false;
+				assert(0 == fclose(file));
+				proc_parse_file(path, first, last, layout, snap);
+				return;
+			}
+		} else
+			proc_learn_line(line, lineno, first, last, layout, snap);
+		++lineno;
+	}
 
-	/* free space */
-	free(param);
+	if (fast && lineno != layout->num_lines)
+		layout->learned = false;	/* shrank: relearn next read */
+	else if (! fast) {
+		layout->num_lines = lineno;
+		layout->learned = (lineno <= PROC_MAX_LINES);
+	}
 
-	/* perform job */
-	x11_sign_display(args.sign, args.sign_active);
-	safe_sleep(TEMP_SIGN_TIME);
-	x11_sign_undisplay(args.sign_active);
-	return NULL;
+	fclose(file);
 }
 
-void x11_sign_display_temp(char sign, bool *ds)
+/* Auxiliar function. Parse the info file fields in one pass. */
+void snapshot_parse_info(struct battery *bat, struct battery_snapshot *snap)
 {
-	struct temp_sign_args *args;
-	pthread_t th;
-
-	/* allocate and store thread arguments */
-	args = (struct temp_sign_args *) malloc(sizeof(struct temp_sign_args));
-	assert(NULL != args);
-	args->sign = sign;
-	args->sign_active = ds;
-
-	/* create thread */
-	assert(0 == pthread_create_dt(&th, x11_temp_sign_control, (void *)args));
+	snap->lowcap = -1;
+	proc_parse_file(bat->info_path, PF_LOWCAP, PF_LOWCAP,
+			&bat->info_layout, snap);
 }
 
-void x11_sign_undisplay(bool *sign_up)
+/* Auxiliar function. Parse the state file fields in one pass. */
+void snapshot_parse_state(struct battery *bat, struct battery_snapshot *snap)
 {
-	if (*sign_up) {
-		x11_send_command(MSG_REMOVE_SIGN);
-		*sign_up = false;
-	}
+	snap->present = false;
+	snap->state = CHST_INVALID;
+	snap->rate = -1;
+	snap->remcap = -1;
+	proc_parse_file(bat->state_path, PF_PRESENT, PF_REMCAP,
+			&bat->state_layout, snap);
 }
 
-/* Alert system global variables. */
-xine_t *alert_engine = NULL;
+/* Auxiliar function. Fill a snapshot from cached sysfs attribute fds. */
+void snapshot_read_sysfs(struct battery *bat, struct battery_snapshot *snap)
+{
+	char buf[LINE_BUFSIZE];
+	long value;
 
-/* Initialize alert system */
+	/* missing present attribute means present while status is readable */
+	value = sysfs_read_int(bat->fd_present);
+	if (-1 == bat->fd_present)
+		snap->present = (-1 != sysfs_read_attr(bat->fd_status, buf, sizeof(buf)));
+	else
+		snap->present = (1 == value);
+
+	if (-1 == sysfs_read_attr(bat->fd_status, buf, sizeof(buf)))
+		snap->state = CHST_INVALID;
+	else if (buf == strstr(buf, "Charging"))
+		snap->state = CHST_CHARGING;
+	else if (buf == strstr(buf, "Discharging"))
+		snap->state = CHST_DISCHARGING;
+	else if (buf == strstr(buf, "Full"))
+		snap->state = CHST_CHARGED;
+	else
+		snap->state = CHST_OTHER;
+
+	/* sysfs reports µWh/µAh and µW/µA; scale to the legacy m-units */
+	value = sysfs_read_int(bat->fd_charge);
+	snap->remcap = (value < 0)? -1 : (int) (value / 1000);
+
+	value = sysfs_read_int(bat->fd_rate);
+	if (-1 == value)
+		snap->rate = -1;
+	else {
+		if (value < 0)
+			value = -value;	/* some drivers sign the discharge current */
+		snap->rate = (int) (value / 1000);
+	}
+
+	value = sysfs_read_int(bat->fd_lowcap);
+	if (value < 0)
+		snap->lowcap = -1;
+	else if (bat->lowcap_design)
+		snap->lowcap = (int) (value / 1000 / 10); /* no alarm: 10% of design */
+	else
+		snap->lowcap = (int) (value / 1000);
+}
+
+/* Auxiliar function. Refresh all snapshots when missing or stale. */
+void snapshot_ensure(void)
+{
+	time_t now = time(NULL);
+	int i;
+
+	if (0 != snapshot_timestamp && now - snapshot_timestamp < SNAPSHOT_MAX_AGE)
+		return;
+
+	/* a single reader batches every battery in one wakeup */
+	for (i = 0; i < num_batteries; i++) {
+		if (BACKEND_SYSFS == batteries[i].backend)
+			snapshot_read_sysfs(&batteries[i], &batteries[i].snap);
+		else {
+			snapshot_parse_info(&batteries[i], &batteries[i].snap);
+			snapshot_parse_state(&batteries[i], &batteries[i].snap);
+		}
+		batteries[i].snap.timestamp = now;
+	}
+	snapshot_timestamp = now;
+}
+
+/* Auxiliar function. Add up one integer field across present batteries. */
+int snapshot_field_total(size_t field_offset)
+{
+	int total = -1;
+	int value;
+	int i;
+
+	snapshot_ensure();
+
+	for (i = 0; i < num_batteries; i++) {
+		if (! batteries[i].snap.present)
+			continue;
+		value = *(int *)((char *)&batteries[i].snap + field_offset);
+		if (-1 == value)
+			continue;
+		total = (-1 == total)? value : total + value;
+	}
+
+	return total;
+}
+
+int get_design_capacity_low(void)
+{
+	return snapshot_field_total(offsetof(struct battery_snapshot, lowcap));
+}
+
+int get_present_rate(void)
+{
+	return snapshot_field_total(offsetof(struct battery_snapshot, rate));
+}
+
+int get_remaining_capacity(void)
+{
+	return snapshot_field_total(offsetof(struct battery_snapshot, remcap));
+}
+
+bool get_present(void)
+{
+	int i;
+
+	snapshot_ensure();
+
+	for (i = 0; i < num_batteries; i++)
+		if (batteries[i].snap.present)
+			return true;
+	return false;
+}
+
+charging_state get_charging_state(void)
+{
+	bool any_present = false;
+	bool has_state[CHST_OTHER + 1] = { false };
+	int i;
+
+	snapshot_ensure();
+
+	for (i = 0; i < num_batteries; i++) {
+		if (! batteries[i].snap.present)
+			continue;
+		any_present = true;
+		has_state[batteries[i].snap.state] = true;
+	}
+
+	if (! any_present)
+		return CHST_NO_BAT;
+
+	/*
+	 * Aggregate pack states: any discharging pack means the system is
+	 * running on battery; otherwise charging takes precedence over
+	 * charged, and unknown states are reported only when alone.
+	 */
+	if (has_state[CHST_DISCHARGING])
+		return CHST_DISCHARGING;
+	if (has_state[CHST_CHARGING])
+		return CHST_CHARGING;
+	if (has_state[CHST_CHARGED])
+		return CHST_CHARGED;
+	if (has_state[CHST_OTHER])
+		return CHST_OTHER;
+	return CHST_INVALID;
+}
+
+/*
+ * Battery state history. Timestamped samples are appended to a fixed-size
+ * ring kept in a memory-mapped binary file, so recording a sample is a few
+ * plain stores with no write() syscall, the history survives restarts, and
+ * fleet tooling can map the file read-only to scrape drain trends without
+ * loading the device.
+ */
+const char HISTORY_FILE[] =	"/var/run/battery_monitor.history";
+
+#define HISTORY_MAGIC		0x42544d48U /* "BTMH" */
+#define HISTORY_ENTRIES		1024
+
+struct history_entry {
+	long timestamp;		/* sample time */
+	int state;		/* charging_state value */
+	int remcap;		/* remaining capacity */
+	int rate;		/* present rate */
+};
+
+struct history_header {
+	unsigned magic;
+	unsigned num_entries;	/* ring capacity */
+	unsigned next;		/* next slot to be written */
+};
+
+struct history_file {
+	struct history_header header;
+	struct history_entry entries[HISTORY_ENTRIES];
+};
+
+/* mapped history ring, NULL when history is disabled */
+struct history_file *history = NULL;
+
+void history_init(void)
+{
+	int fd;
+	void *map;
+
+	fd = open(HISTORY_FILE, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (-1 == fd) {
+		fprintf(stderr, "Warning: unable to open history file, history disabled\n");
+		return;
+	}
+
+	if (-1 == ftruncate(fd, (off_t) sizeof(struct history_file))) {
+		fprintf(stderr, "Warning: unable to size history file, history disabled\n");
+		assert(0 == close(fd));
+		return;
+	}
+
+	map = mmap(NULL, sizeof(struct history_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	assert(0 == close(fd));
+	if (MAP_FAILED == map) {
+		fprintf(stderr, "Warning: unable to map history file, history disabled\n");
+		return;
+	}
+
+	history = (struct history_file *) map;
+
+	/* reinitialize unless a valid ring from a previous run was mapped */
+	if (HISTORY_MAGIC != history->header.magic || HISTORY_ENTRIES != history->header.num_entries) {
+		memset(history, 0, sizeof(struct history_file));
+		history->header.num_entries = HISTORY_ENTRIES;
+		history->header.next = 0;
+		history->header.magic = HISTORY_MAGIC;
+	}
+}
+
+void history_append(charging_state state)
+{
+	struct history_entry *entry;
+
+	if (NULL == history)
+		return;
+
+	entry = &history->entries[history->header.next % HISTORY_ENTRIES];
+	entry->timestamp = (long) time(NULL);
+	entry->state = (int) state;
+	entry->remcap = get_remaining_capacity();
+	entry->rate = get_present_rate();
+
+	/* publish the slot before advancing, for read-only scrapers */
+	__sync_synchronize();
+	history->header.next++;
+}
+
+/*
+ * Crash-safe decision state. The safety-time countdown lives in warnnum on
+ * main()'s stack, so a supervisor restart during a low-battery episode used
+ * to reset it and delay the shutdown decision by up to another full safety
+ * time. warnnum and the shutdown status are now checkpointed every cycle
+ * into a tiny memory-mapped file with the same technique as the history
+ * ring (a few plain stores, no write() syscall) and restored at startup
+ * when the checkpoint is recent enough to describe the same episode.
+ */
+const char STATE_FILE[] =	"/var/run/battery_monitor.state";
+
+#define STATE_MAGIC		0x42544d53U /* "BTMS" */
+#define STATE_MAX_AGE		(5 * 60) /* seconds a checkpoint stays valid */
+
+struct state_file {
+	unsigned magic;
+	long timestamp;		/* time of last checkpoint */
+	int warnnum;		/* warnings so far */
+	int shutdown_launched;	/* shutdown process running? */
+};
+
+/* mapped state file, NULL when checkpointing is disabled */
+struct state_file *state = NULL;
+
+void state_init(void)
+{
+	int fd;
+	void *map;
+
+	fd = open(STATE_FILE, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (-1 == fd) {
+		fprintf(stderr, "Warning: unable to open state file, checkpoints disabled\n");
+		return;
+	}
+
+	if (-1 == ftruncate(fd, (off_t) sizeof(struct state_file))) {
+		fprintf(stderr, "Warning: unable to size state file, checkpoints disabled\n");
+		assert(0 == close(fd));
+		return;
+	}
+
+	map = mmap(NULL, sizeof(struct state_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	assert(0 == close(fd));
+	if (MAP_FAILED == map) {
+		fprintf(stderr, "Warning: unable to map state file, checkpoints disabled\n");
+		return;
+	}
+
+	state = (struct state_file *) map;
+}
+
+void state_restore(int *warnnum, bool *shutdown_launched)
+{
+	long age;
+
+	*warnnum = 0;
+	*shutdown_launched = false;
+
+	if (NULL == state || STATE_MAGIC != state->magic)
+		return;
+
+	/* a stale checkpoint (or one from a skewed clock) describes an
+	 * episode that is already over: start clean */
+	age = (long) (time(NULL) - state->timestamp);
+	if (age < 0 || age > STATE_MAX_AGE)
+		return;
+
+	*warnnum = state->warnnum;
+	*shutdown_launched = (0 != state->shutdown_launched);
+}
+
+void state_checkpoint(int warnnum, bool shutdown_launched)
+{
+	if (NULL == state)
+		return;
+
+	state->warnnum = warnnum;
+	state->shutdown_launched = (int) shutdown_launched;
+
+	/* publish the fields before the timestamp validates them */
+	__sync_synchronize();
+	state->timestamp = (long) time(NULL);
+	state->magic = STATE_MAGIC;
+}
+
+/*
+ * Time-to-empty prediction. An exponentially-weighted moving average of the
+ * drain rate is updated in O(1) per discharging sample, and the projected
+ * time to empty follows from the remaining capacity over that average. The
+ * EWMA smooths over voltage sag on old packs, where the raw instantaneous
+ * rate would trip a pure capacity threshold too late or too early.
+ */
+double tte_drain_rate = -1.0;	/* EWMA of drain rate, negative when unseeded */
+
+void prediction_update(charging_state state)
+{
+	int rate;
+
+	/* every discharge episode starts with a fresh average */
+	if (CHST_DISCHARGING != state) {
+		tte_drain_rate = -1.0;
+		return;
+	}
+
+	rate = get_present_rate();
+	if (rate <= 0)
+		return;
+
+	if (tte_drain_rate < 0.0)
+		tte_drain_rate = (double) rate;	/* seed from the first sample */
+	else
+		tte_drain_rate += TTE_EWMA_WEIGHT * ((double) rate - tte_drain_rate);
+}
+
+long prediction_time_to_empty(void)
+{
+	int remcap;
+
+	if (tte_drain_rate <= 0.0)
+		return -1;
+
+	remcap = get_remaining_capacity();
+	if (-1 == remcap)
+		return -1;
+
+	/* remaining capacity in mWh over a rate in mW gives hours */
+	return (long) ((double) remcap / tte_drain_rate * 3600.0);
+}
+
+/*
+ * Structured event log. On units with broken ACPI firmware the warning
+ * paths fire every cycle, and one unbuffered fprintf() per warning was a
+ * top syscall source. Warnings are now fixed-size binary records appended
+ * to a userspace buffer: a repeat of the previous record only bumps its
+ * count and timestamp (a few stores), and the buffer goes out in a single
+ * write() when it fills or when its oldest record has aged enough. With
+ * the log file unavailable the records fall back to stderr as before.
+ */
+const char EVENT_LOG_FILE[] =	"/var/run/battery_monitor.events";
+
+struct event_record event_buffer[EVENT_BUFFER_RECORDS];
+int event_buffer_used = 0;
+time_t event_oldest = 0;	/* timestamp of the oldest pending record */
+int event_fd = -1;		/* log file, -1 falls back to stderr */
+
+void event_init(void)
+{
+	event_fd = open(EVENT_LOG_FILE, O_WRONLY | O_CREAT | O_APPEND,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (-1 == event_fd)
+		fprintf(stderr, "Warning: unable to open event log, using stderr\n");
+}
+
+void event_log(int id, long value)
+{
+	struct event_record *record;
+
+	if (-1 == event_fd) {
+		fprintf(stderr, "%s\n", x11_signs[id].text);
+		return;
+	}
+
+	/* repeated identical warning: collapse into the previous record */
+	if (event_buffer_used > 0) {
+		record = event_buffer + (event_buffer_used - 1);
+		if (id == record->id && value == record->value) {
+			record->count++;
+			record->timestamp = (long) time(NULL);
+			event_flush();
+			return;
+		}
+	}
+
+	record = event_buffer + event_buffer_used;
+	record->id = id;
+	record->count = 1;
+	record->timestamp = (long) time(NULL);
+	record->value = value;
+	if (1 == ++event_buffer_used)
+		event_oldest = (time_t) record->timestamp;
+
+	event_flush();
+}
+
+void event_flush(void)
+{
+	ssize_t retval;
+
+	if (0 == event_buffer_used || -1 == event_fd)
+		return;
+
+	/* keep batching until the buffer fills or the head record ages */
+	if (event_buffer_used < EVENT_BUFFER_RECORDS &&
+	    time(NULL) - event_oldest < EVENT_FLUSH_PERIOD)
+		return;
+
+	retval = write(event_fd, event_buffer,
+		       event_buffer_used * sizeof(struct event_record));
+	if (-1 == retval)
+		fprintf(stderr, "Warning: unable to write event log\n");
+	event_buffer_used = 0;
+}
+
+/*
+ * Acquisition trace. When enabled from the config file ("trace = 1") every
+ * per-cycle acquisition result is appended as a compact binary record to a
+ * trace file, buffered and written in batches like the event log. A trace
+ * recorded on a misbehaving unit replays deterministically through the
+ * bench harness ("battery_monitor_bench -r"), so a ten-hour discharge
+ * incident reproduces in seconds without hardware in the loop.
+ */
+const char TRACE_FILE[] =	"/var/run/battery_monitor.trace";
+
+#define TRACE_BUFFER_RECORDS	64 /* pending trace records */
+
+struct trace_record trace_buffer[TRACE_BUFFER_RECORDS];
+int trace_buffer_used = 0;
+int trace_fd = -1;	/* opened on first capture */
+
+void trace_capture(charging_state state)
+{
+	struct trace_record *record;
+	ssize_t retval;
+
+	if (! cfg_trace)
+		return;
+
+	if (-1 == trace_fd) {
+		trace_fd = open(TRACE_FILE, O_WRONLY | O_CREAT | O_APPEND,
+				S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (-1 == trace_fd) {
+			fprintf(stderr, "Warning: unable to open trace file, tracing disabled\n");
+			cfg_trace = 0;
+			return;
+		}
+	}
+
+	record = trace_buffer + trace_buffer_used;
+	record->timestamp = (long) time(NULL);
+	record->state = (int) state;
+	record->remcap = get_remaining_capacity();
+	record->rate = get_present_rate();
+	record->lowcap = get_design_capacity_low();
+
+	if (TRACE_BUFFER_RECORDS == ++trace_buffer_used) {
+		retval = write(trace_fd, trace_buffer, sizeof(trace_buffer));
+		if (-1 == retval)
+			fprintf(stderr, "Warning: unable to write trace file\n");
+		trace_buffer_used = 0;
+	}
+}
+
+/*
+ * Self-monitoring watchdog. The daemon runs unattended for months on boxes
+ * where core dumps are disabled, so a slow leak is only visible if the
+ * process measures itself. Every WATCHDOG_PERIOD seconds it samples its own
+ * open fd count, resident set size and thread count from /proc/self and
+ * compares them against the configured budgets; a breach logs a one-time
+ * diagnostic dump listing every open descriptor. The numbers also go out
+ * through the metrics segment for external trending.
+ */
+int watchdog_open_fds = -1;	/* latest samples, -1 until first run */
+int watchdog_rss_kb = -1;
+int watchdog_num_threads = -1;
+
+/* Auxiliar function. Counts entries in /proc/self/fd. */
+int watchdog_count_fds(void)
+{
+	DIR *dir;
+	struct dirent *entry;
+	int count;
+
+	dir = opendir("/proc/self/fd");
+	if (NULL == dir)
+		return -1;
+
+	count = 0;
+	while (NULL != (entry = readdir(dir)))
+		if ('.' != entry->d_name[0])
+			++count;
+	assert(0 == closedir(dir));
+
+	return count - 1;	/* opendir() itself holds one */
+}
+
+/* Auxiliar function. Reads RSS (kb) and thread count from /proc/self. */
+void watchdog_read_status(int *rss_kb, int *num_threads)
+{
+	FILE *file;
+	char line[LINE_BUFSIZE];
+	long pages;
+
+	*rss_kb = -1;
+	*num_threads = -1;
+
+	file = fopen("/proc/self/statm", "r");
+	if (NULL != file) {
+		if (1 == fscanf(file, "%*d %ld", &pages))
+			*rss_kb = (int) (pages * (sysconf(_SC_PAGESIZE) / 1024));
+		assert(0 == fclose(file));
+	}
+
+	file = fopen("/proc/self/status", "r");
+	if (NULL != file) {
+		while (NULL != fgets(line, sizeof(line), file))
+			if (1 == sscanf(line, "Threads: %d", num_threads))
+				break;
+		assert(0 == fclose(file));
+	}
+}
+
+/* Auxiliar function. Lists every open descriptor and its target. */
+void watchdog_dump(void)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char path[LINE_BUFSIZE + sizeof(entry->d_name)];
+	char target[LINE_BUFSIZE];
+	ssize_t length;
+
+	fprintf(stderr, "Warning: resource budget exceeded: %d fds, %d kb rss, %d threads\n",
+		watchdog_open_fds, watchdog_rss_kb, watchdog_num_threads);
+
+	dir = opendir("/proc/self/fd");
+	if (NULL == dir)
+		return;
+
+	while (NULL != (entry = readdir(dir))) {
+		if ('.' == entry->d_name[0])
+			continue;
+		snprintf(path, sizeof(path), "/proc/self/fd/%s", entry->d_name);
+		length = readlink(path, target, sizeof(target) - 1);
+		if (-1 == length)
+			continue;
+		target[length] = '\0';
+		fprintf(stderr, "\tfd %s: %s\n", entry->d_name, target);
+	}
+	assert(0 == closedir(dir));
+}
+
+void watchdog_sample(void)
+{
+	static time_t last_sample = 0;
+	static bool over_budget = false;
+	time_t now;
+	bool breach;
+
+	now = time(NULL);
+	if (0 != last_sample && now - last_sample < WATCHDOG_PERIOD)
+		return;
+	last_sample = now;
+
+	watchdog_open_fds = watchdog_count_fds();
+	watchdog_read_status(&watchdog_rss_kb, &watchdog_num_threads);
+
+	/* dump once per breach, not once per sample */
+	breach = (watchdog_open_fds > cfg_fd_budget ||
+		  watchdog_rss_kb > cfg_rss_budget_kb ||
+		  watchdog_num_threads > cfg_thread_budget);
+	if (breach && !over_budget)
+		watchdog_dump();
+	over_budget = breach;
+}
+
+/*
+ * Shared-memory metrics. The latest parsed state is published into a POSIX
+ * shared memory segment guarded by a seqlock: the writer bumps the sequence
+ * to an odd value, stores the fields and bumps it back to even, so readers
+ * retry when they see an odd or changed sequence and otherwise get a
+ * consistent snapshot without any syscall on the daemon side.
+ */
+const char METRICS_SEGMENT[] =	"/battery_monitor";
+
+#define METRICS_MAGIC		0x42544d4dU /* "BTMM" */
+
+struct metrics_segment {
+	unsigned magic;
+	volatile unsigned seq;	/* odd while an update is in progress */
+	long timestamp;		/* time of last publication */
+	int state;		/* charging_state value */
+	int remcap;		/* remaining capacity */
+	int lowlimit;		/* low capacity limit */
+	int rate;		/* present rate */
+	long tte;		/* projected time to empty, -1 unknown */
+	int warnnum;		/* warnings so far */
+	int shutdown_launched;	/* shutdown process running? */
+	int num_batteries;	/* monitored packs */
+	int open_fds;		/* watchdog: open descriptors, -1 unknown */
+	int rss_kb;		/* watchdog: resident set size, -1 unknown */
+	int num_threads;	/* watchdog: live threads, -1 unknown */
+};
+
+/* mapped metrics segment, NULL when metrics are disabled */
+struct metrics_segment *metrics = NULL;
+
+void metrics_init(void)
+{
+	int fd;
+	void *map;
+
+	fd = shm_open(METRICS_SEGMENT, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (-1 == fd) {
+		fprintf(stderr, "Warning: unable to open metrics segment, metrics disabled\n");
+		return;
+	}
+
+	if (-1 == ftruncate(fd, (off_t) sizeof(struct metrics_segment))) {
+		fprintf(stderr, "Warning: unable to size metrics segment, metrics disabled\n");
+		assert(0 == close(fd));
+		return;
+	}
+
+	map = mmap(NULL, sizeof(struct metrics_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	assert(0 == close(fd));
+	if (MAP_FAILED == map) {
+		fprintf(stderr, "Warning: unable to map metrics segment, metrics disabled\n");
+		return;
+	}
+
+	metrics = (struct metrics_segment *) map;
+	memset(metrics, 0, sizeof(struct metrics_segment));
+	metrics->magic = METRICS_MAGIC;
+}
+
+/* process-local copy of the last published metrics, for query replies */
+struct metrics_segment metrics_snapshot;
+
+void metrics_publish(charging_state state, int warnnum, bool shutdown_launched)
+{
+	metrics_snapshot.magic = METRICS_MAGIC;
+	metrics_snapshot.timestamp = (long) time(NULL);
+	metrics_snapshot.state = (int) state;
+	metrics_snapshot.remcap = get_remaining_capacity();
+	metrics_snapshot.lowlimit = get_design_capacity_low();
+	metrics_snapshot.rate = get_present_rate();
+	metrics_snapshot.tte = prediction_time_to_empty();
+	metrics_snapshot.warnnum = warnnum;
+	metrics_snapshot.shutdown_launched = (int) shutdown_launched;
+	metrics_snapshot.num_batteries = num_batteries;
+	metrics_snapshot.open_fds = watchdog_open_fds;
+	metrics_snapshot.rss_kb = watchdog_rss_kb;
+	metrics_snapshot.num_threads = watchdog_num_threads;
+
+	if (NULL == metrics)
+		return;
+
+	metrics->seq++;		/* odd: update in progress */
+	__sync_synchronize();
+
+	metrics->timestamp = metrics_snapshot.timestamp;
+	metrics->state = metrics_snapshot.state;
+	metrics->remcap = metrics_snapshot.remcap;
+	metrics->lowlimit = metrics_snapshot.lowlimit;
+	metrics->rate = metrics_snapshot.rate;
+	metrics->tte = metrics_snapshot.tte;
+	metrics->warnnum = metrics_snapshot.warnnum;
+	metrics->shutdown_launched = metrics_snapshot.shutdown_launched;
+	metrics->num_batteries = metrics_snapshot.num_batteries;
+	metrics->open_fds = metrics_snapshot.open_fds;
+	metrics->rss_kb = metrics_snapshot.rss_kb;
+	metrics->num_threads = metrics_snapshot.num_threads;
+
+	__sync_synchronize();
+	metrics->seq++;		/* even again: snapshot consistent */
+}
+
+/*
+ * Local query socket. Fleet tooling connects to a UNIX domain socket and
+ * receives one binary metrics_segment record built from the in-memory
+ * snapshot, so a query costs microseconds and no /proc parsing. The
+ * listening socket joins the select() set in safe_sleep(), the same
+ * pattern the sign control thread uses for its command pipe.
+ */
+const char QUERY_SOCKET[] =	"/var/run/battery_monitor.sock";
+
+#define QUERY_BACKLOG		4
+
+/* listening query socket, -1 when queries are disabled */
+int query_fd = -1;
+
+void query_init(void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (-1 == fd) {
+		fprintf(stderr, "Warning: unable to create query socket, queries disabled\n");
+		return;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	assert(strlen(QUERY_SOCKET) < sizeof(addr.sun_path));
+	strcpy(addr.sun_path, QUERY_SOCKET);
+	unlink(QUERY_SOCKET);	/* stale socket from a previous run */
+
+	if (-1 == bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "Warning: unable to bind query socket, queries disabled\n");
+		assert(0 == close(fd));
+		return;
+	}
+
+	if (-1 == listen(fd, QUERY_BACKLOG)) {
+		fprintf(stderr, "Warning: unable to listen on query socket, queries disabled\n");
+		assert(0 == close(fd));
+		return;
+	}
+
+	assert(-1 != fcntl(fd, F_SETFL, O_NONBLOCK));
+	query_fd = fd;
+	sleep_watch_fd(query_fd);
+}
+
+void query_handle(void)
+{
+	int conn;
+	ssize_t written;
+
+	for (;;) {
+		conn = accept(query_fd, NULL, NULL);
+		if (-1 == conn) {
+			if (errno == EINTR)
+				continue;
+			break;	/* no more pending connections */
+		}
+
+		written = write(conn, &metrics_snapshot, sizeof(metrics_snapshot));
+		if (sizeof(metrics_snapshot) != (size_t) written)
+			fprintf(stderr, "Warning: short query reply\n");
+		assert(0 == close(conn));
+	}
+}
+
+/*
+ * One-shot query mode (--query). Runs only the acquisition path and prints
+ * a single machine-readable line, so scripts get state and capacity in
+ * milliseconds without the X11 and xine startup cost of the daemon.
+ */
+int query_oneshot(void)
+{
+	static const char *state_names[] = {
+		"invalid",	/* CHST_INVALID */
+		"charging",	/* CHST_CHARGING */
+		"charged",	/* CHST_CHARGED */
+		"discharging",	/* CHST_DISCHARGING */
+		"no_battery",	/* CHST_NO_BAT */
+		"other"		/* CHST_OTHER */
+	};
+
+	charging_state state;
+
+	batteries_init();
+	state = get_charging_state();
+	prediction_update(state);	/* seed from the instantaneous rate */
+
+	printf("state=%s remcap=%d lowlimit=%d rate=%d tte=%ld batteries=%d\n",
+		state_names[state],
+		get_remaining_capacity(),
+		get_design_capacity_low(),
+		get_present_rate(),
+		prediction_time_to_empty(),
+		num_batteries);
+
+	return EXIT_SUCCESS;
+}
+
+/* Auxiliar function. Create a thread in detached mode. */
+int pthread_create_dt(pthread_t *th, void *(*rout)(void *), void *arg)
+{
+	int retval;
+	pthread_attr_t at;
+
+	assert(0 == pthread_attr_init(&at));
+	assert(0 == pthread_attr_setdetachstate(&at, PTHREAD_CREATE_DETACHED));
+	retval = pthread_create(th, &at, rout, arg);
+	assert(0 == pthread_attr_destroy(&at));
+
+	return retval;
+}
+
+/* drawing data needed for any thread that handles signs */
+struct drawing_data {
+	Display *display;
+	GC context;
+	int xpos;
+	int ypos;
+	XFontStruct *font;
+	Window sign_windows[MSG_NUM_SIGNS];	/* one window per sign */
+	Pixmap sign_pixmaps[MSG_NUM_SIGNS];	/* pre-rendered signs */
+	unsigned sign_widths[MSG_NUM_SIGNS];
+	unsigned sign_heights[MSG_NUM_SIGNS];
+	bool sign_visible[MSG_NUM_SIGNS];	/* mapped right now */
+};
+
+/* global drawing data */
+struct drawing_data x11_dd;
+
+/* pipe to communicate with sign control routine */
+int x11_pipe[2];
+
+/* persistent event set of the control routine: connection and pipe */
+int x11_epoll_fd = -1;
+
+/* auxiliar function to send a command to the x11 sign routine */
+void x11_send_command(char command)
+{
+	int retval;
+	for (;;) {
+		retval = write(x11_pipe[WRITE_FD], &command, sizeof(char));
+		if (retval == 0)
+			continue;
+		if (retval == -1 && errno == EINTR)
+			continue;
+		assert(retval != -1);
+		break;
+	}
+}
+
+/* auxiliar function to blit one sign pixmap into its own window */
+void x11_blit_sign(int sign)
+{
+	if (sign < 0 || ! x11_dd.sign_visible[sign])
+		return;
+
+	XCopyArea(x11_dd.display, x11_dd.sign_pixmaps[sign], x11_dd.sign_windows[sign], x11_dd.context, 0, 0, x11_dd.sign_widths[sign], x11_dd.sign_heights[sign], 0, 0);
+}
+
+/* auxiliar function to find the sign owning a window, -1 if unknown */
+int x11_sign_for_window(Window win)
+{
+	int sign;
+
+	for (sign = 0; sign < MSG_NUM_SIGNS; sign++)
+		if (win == x11_dd.sign_windows[sign])
+			return sign;
+
+	return -1;
+}
+
+/* auxiliar function to stack the visible sign windows vertically */
+void x11_restack_signs(void)
+{
+	int ypos = WIN_YPOS;
+	int sign;
+
+	for (sign = 0; sign < MSG_NUM_SIGNS; sign++) {
+		if (! x11_dd.sign_visible[sign])
+			continue;
+		XMoveWindow(x11_dd.display, x11_dd.sign_windows[sign], WIN_XPOS, ypos);
+		ypos += (int) x11_dd.sign_heights[sign] + WIN_PADDING;
+	}
+}
+
+/* auxiliar function to map the window of one sign */
+void x11_show_sign(int sign)
+{
+	assert(sign >= 0 && sign < MSG_NUM_SIGNS);
+	if (x11_dd.sign_visible[sign])
+		return;
+
+	x11_dd.sign_visible[sign] = true;
+	x11_restack_signs();
+	XMapWindow(x11_dd.display, x11_dd.sign_windows[sign]);
+	x11_blit_sign(sign);
+}
+
+/* auxiliar function to unmap the window of one sign */
+void x11_hide_sign(int sign)
+{
+	assert(sign >= 0 && sign < MSG_NUM_SIGNS);
+	if (! x11_dd.sign_visible[sign])
+		return;
+
+	XUnmapWindow(x11_dd.display, x11_dd.sign_windows[sign]);
+	x11_dd.sign_visible[sign] = false;
+	x11_restack_signs();
+}
+
+/* auxiliar function to apply one control command to the sign windows */
+void x11_apply_command(char command, time_t *temp_deadline, int *temp_sign)
+{
+	int sign;
+
+	if (command >= 0 && command < MSG_NUM_SIGNS) {
+		/* persistent display supersedes a temporal one */
+		if ((int) command == *temp_sign) {
+			*temp_deadline = 0;
+			*temp_sign = -1;
+		}
+		x11_show_sign((int) command);
+	}
+	else if (MSG_REMOVE_SIGN == command) {
+		*temp_deadline = 0;
+		*temp_sign = -1;
+		for (sign = 0; sign < MSG_NUM_SIGNS; sign++)
+			x11_hide_sign(sign);
+	}
+	else if (command >= MSG_REMOVE_BASE && command < MSG_REMOVE_BASE + MSG_NUM_SIGNS) {
+		sign = (int) (command - MSG_REMOVE_BASE);
+		if (sign == *temp_sign) {
+			*temp_deadline = 0;
+			*temp_sign = -1;
+		}
+		x11_hide_sign(sign);
+	}
+	else {
+		assert(command >= MSG_TEMP_BASE && command < MSG_TEMP_BASE + MSG_NUM_SIGNS);
+		sign = (int) (command - MSG_TEMP_BASE);
+		/* a single temporal sign is tracked: replace the old one */
+		if (-1 != *temp_sign && sign != *temp_sign)
+			x11_hide_sign(*temp_sign);
+		x11_show_sign(sign);
+		*temp_sign = sign;
+		*temp_deadline = time(NULL) + cfg_temp_sign_time;
+	}
+}
+
+/* sign control routine, receives commands and responds to events */
+void *x11_sign_control_routine(void *unused)
+{
+	struct epoll_event events[2];
+	int connection;
+	int timeout;
+	time_t temp_deadline = 0;	/* temporal sign expiry, 0 if none */
+	int temp_sign = -1;		/* sign the deadline refers to */
+	long remaining;
+	int nevents;
+	int retval;
+	char command;
+	bool have_command;
+	XEvent ev;
+	int i;
+
+	connection = ConnectionNumber(x11_dd.display);
+
+	for (;;) {
+		/* expire the pending temporal sign when its deadline passes */
+		timeout = -1;
+		if (0 != temp_deadline) {
+			remaining = (long) (temp_deadline - time(NULL));
+			if (remaining <= 0) {
+				temp_deadline = 0;
+				if (-1 != temp_sign)
+					x11_hide_sign(temp_sign);
+				temp_sign = -1;
+				XFlush(x11_dd.display);
+				continue;
+			}
+			timeout = (int) (remaining * 1000L);
+		}
+
+		/* wait on the persistent event set */
+		while (-1 == (nevents = epoll_wait(x11_epoll_fd, events, 2, timeout)) && errno == EINTR)
+			;
+		assert(nevents != -1);
+		if (0 == nevents)
+			continue;	/* deadline reached: expire above */
+
+		for (i = 0; i < nevents; i++) {
+
+			/* check commands: drain the burst, one flush for all
+			 * of it; with one window per sign the commands are no
+			 * longer collapsible, so each one is applied */
+			if (x11_pipe[READ_FD] == events[i].data.fd) {
+				have_command = false;
+
+				for (;;) {
+					retval = read(x11_pipe[READ_FD], &command, sizeof(char));
+					if (-1 == retval && errno == EINTR)
+						continue;
+					if (-1 == retval) {
+						assert(EAGAIN == errno || EWOULDBLOCK == errno);
+						break;	/* burst drained */
+					}
+					assert(1 == retval);
+					have_command = true;
+					x11_apply_command(command, &temp_deadline, &temp_sign);
+				}
+
+				if (have_command)
+					XFlush(x11_dd.display);
+			}
+
+			/* check X11 events */
+			if (connection == events[i].data.fd) {
+				if (XPending(x11_dd.display) == 0) {
+					fprintf(stderr, "Warning: activity in X11 connection but no events\n");
+					continue;
+				}
+
+				XNextEvent(x11_dd.display, &ev);
+				switch (ev.type) {
+				case Expose:
+					if (ev.xexpose.count != 0)
+						break;
+				case VisibilityNotify:
+				case MapNotify:
+					x11_blit_sign(x11_sign_for_window(ev.xany.window));
+					XFlush(x11_dd.display);
+					break;
+				default:
+					break;
+				}
+			}
+		}
+	}
+
+	return NULL; /* unreachable */
+}
+
+void x11_sign_init(void)
+{
+	/* prepare drawing data */
+	pthread_t control_thread;
+	int screen;
+	Colormap cmap;
+	XColor color;
+	unsigned long color_background;
+	unsigned long color_foreground;
+	XSetWindowAttributes attr;
+	struct epoll_event epev;
+	unsigned depth;
+	size_t sign_len;
+	int i;
+
+	/* prepare X11 for multithreading */
+	assert(XInitThreads());
+
+	/* prepare sign control pipe; reads must not block while draining */
+	assert(0 == pipe(x11_pipe));
+	assert(-1 != fcntl(x11_pipe[READ_FD], F_SETFL, O_NONBLOCK));
+
+	/* the control routine waits on a persistent event set of its own */
+	x11_epoll_fd = epoll_create(2);
+	assert(-1 != x11_epoll_fd);
+
+	/* open display */
+	x11_dd.display = NULL;
+	x11_dd.display = XOpenDisplay(NULL);
+	assert (NULL != x11_dd.display);
+
+	/* register the two fds once; they live as long as the process */
+	epev.events = EPOLLIN;
+	epev.data.fd = x11_pipe[READ_FD];
+	assert(0 == epoll_ctl(x11_epoll_fd, EPOLL_CTL_ADD, x11_pipe[READ_FD], &epev));
+	epev.data.fd = ConnectionNumber(x11_dd.display);
+	assert(0 == epoll_ctl(x11_epoll_fd, EPOLL_CTL_ADD, epev.data.fd, &epev));
+
+	/* get default screen */
+	screen = DefaultScreen(x11_dd.display);
+
+	/* get colors */
+	cmap = DefaultColormap(x11_dd.display, screen);
+	assert(0 != XAllocNamedColor(x11_dd.display, cmap, "red", &color, &color));
+	color_background = color.pixel;
+	assert(0 != XAllocNamedColor(x11_dd.display, cmap, "white", &color, &color));
+	color_foreground = color.pixel;
+
+	/* get a font for the text */
+	x11_dd.font = XLoadQueryFont(x11_dd.display, arg_win_font);
+	assert (NULL != x11_dd.font);
+
+	/* create one window per sign, sized from the rendered text, so
+	 * concurrent signs stack instead of overwriting one another */
+	x11_dd.xpos = WIN_PADDING;
+	x11_dd.ypos = x11_dd.font->ascent + WIN_PADDING;
+	attr.background_pixel = color_background;
+	attr.override_redirect = True;
+
+	for (i = 0; i < MSG_NUM_SIGNS; i++) {
+		sign_len = x11_signs[i].length;
+		x11_dd.sign_widths[i] = XTextWidth(x11_dd.font, x11_signs[i].text, sign_len) + WIN_PADDING + WIN_PADDING;
+		x11_dd.sign_heights[i] = x11_dd.ypos + x11_dd.font->descent + WIN_PADDING;
+		x11_dd.sign_visible[i] = false;
+
+		x11_dd.sign_windows[i] = XCreateWindow(x11_dd.display, RootWindow(x11_dd.display, screen), WIN_XPOS, WIN_YPOS, x11_dd.sign_widths[i], x11_dd.sign_heights[i], 0, CopyFromParent, InputOutput, CopyFromParent, CWOverrideRedirect | CWBackPixel, &attr);
+
+		switch (x11_dd.sign_windows[i]) {
+		case BadAlloc:
+		case BadColor:
+		case BadCursor:
+		case BadMatch:
+		case BadPixmap:
+		case BadValue:
+		case BadWindow:
+			assert(false); /* internal error !!! */
+			break;
+		default:
+			break;
+		}
+
+		/* select window events to receive */
+		assert(BadWindow != XSelectInput(x11_dd.display, x11_dd.sign_windows[i], StructureNotifyMask | ExposureMask | VisibilityChangeMask));
+	}
+
+	/* create graphical context, shared by every window and pixmap */
+	x11_dd.context = XCreateGC(x11_dd.display, x11_dd.sign_windows[0], 0UL, NULL);
+
+	switch (XSetForeground(x11_dd.display, x11_dd.context, color_foreground)) {
+	case BadAlloc:
+	case BadGC:
+	case BadValue:
+		assert(false); /* internal error !!! */
+		break;
+	default:
+		break;
+	}
+
+	switch (XSetBackground(x11_dd.display, x11_dd.context, color_background)) {
+	case BadAlloc:
+	case BadGC:
+	case BadValue:
+		assert(false); /* internal error !!! */
+		break;
+	default:
+		break;
+	}
+
+	switch (XSetFont(x11_dd.display, x11_dd.context, x11_dd.font->fid)) {
+	case BadAlloc:
+	case BadGC:
+	case BadFont:
+		assert(false); /* internal error !!! */
+		break;
+	default:
+		break;
+	}
+
+	/* pre-render every sign into a server-side pixmap */
+	depth = DefaultDepth(x11_dd.display, screen);
+	for (i = 0; i < MSG_NUM_SIGNS; i++) {
+		sign_len = x11_signs[i].length;
+		x11_dd.sign_pixmaps[i] = XCreatePixmap(x11_dd.display, RootWindow(x11_dd.display, screen), x11_dd.sign_widths[i], x11_dd.sign_heights[i], depth);
+
+		XSetForeground(x11_dd.display, x11_dd.context, color_background);
+		XFillRectangle(x11_dd.display, x11_dd.sign_pixmaps[i], x11_dd.context, 0, 0, x11_dd.sign_widths[i], x11_dd.sign_heights[i]);
+		XSetForeground(x11_dd.display, x11_dd.context, color_foreground);
+		XDrawString(x11_dd.display, x11_dd.sign_pixmaps[i], x11_dd.context, x11_dd.xpos, x11_dd.ypos, x11_signs[i].text, sign_len);
+	}
+
+	pthread_create_dt(&control_thread, x11_sign_control_routine, NULL);
+}
+
+/* X11 is brought up lazily: many units never display a sign. */
+pthread_once_t x11_sign_once = PTHREAD_ONCE_INIT;
+
+void x11_sign_ensure(void)
+{
+	assert(0 == pthread_once(&x11_sign_once, x11_sign_init));
+}
+
+/* persistent sign currently requested by the main loop */
+char x11_cur_sign = '\0';
+
+void x11_sign_display(char sign, bool *sign_up)
+{
+	x11_sign_ensure();
+
+	if (*sign_up && sign == x11_cur_sign)
+		return;
+
+	if (*sign_up)
+		x11_sign_undisplay(sign_up);
+
+	x11_send_command(sign);
+	*sign_up = true;
+	x11_cur_sign = sign;
+}
+
+void x11_sign_display_temp(char sign)
+{
+	/*
+	 * Temporal signs need no thread of their own: the command carries
+	 * the sign and the control thread keeps an expiry deadline for it,
+	 * served from the timeout of its own event loop. With one window
+	 * per sign their visibility is the control thread's business only;
+	 * the persistent-sign tracking of the main loop is never touched.
+	 */
+	x11_sign_ensure();
+	x11_send_command((char) (MSG_TEMP_BASE + sign));
+}
+
+void x11_sign_undisplay(bool *sign_up)
+{
+	/* only the requested persistent sign goes away: a temporal warning
+	 * sign sharing the screen keeps its own window until it expires */
+	if (*sign_up) {
+		x11_send_command((char) (MSG_REMOVE_BASE + x11_cur_sign));
+		*sign_up = false;
+	}
+}
+
+/* Alert system global variables. */
+xine_t *alert_engine = NULL;
+xine_audio_port_t *alert_audioport = NULL;
+xine_stream_t *alert_streams[ALERT_STOPSHUTDOWN + 1];
+
+/* Initialize alert system */
 void alert_init(void)
 {
-	alert_engine = xine_new();
-	if (alert_engine == NULL) {
-		fprintf(stderr, "Error: unable to initalize sound system\n");
-		exit(EXIT_FAILURE);
+	const char *audiofiles[ALERT_STOPSHUTDOWN + 1];
+	int i;
+
+	alert_engine = xine_new();
+	if (alert_engine == NULL) {
+		fprintf(stderr, "Error: unable to initalize sound system\n");
+		exit(EXIT_FAILURE);
+	}
+	xine_init(alert_engine);
+
+	/* open the audio driver once for the whole process lifetime */
+	alert_audioport = xine_open_audio_driver(alert_engine, NULL, NULL);
+	if (alert_audioport == NULL) {
+		fprintf(stderr, "Warning: unable to open audio driver, alerts disabled\n");
+		return;
+	}
+
+	audiofiles[ALERT_LOWBAT] = arg_soundfile_lowbat;
+	audiofiles[ALERT_STARTSHUTDOWN] = arg_soundfile_startsd;
+	audiofiles[ALERT_STOPSHUTDOWN] = arg_soundfile_stopsd;
+
+	/* pre-open one persistent stream per alert sound */
+	for (i = ALERT_LOWBAT; i <= ALERT_STOPSHUTDOWN; i++) {
+		alert_streams[i] = xine_stream_new(alert_engine, alert_audioport, NULL);
+		if (NULL == alert_streams[i]) {
+			fprintf(stderr, "Warning: unable to create stream for %s\n", audiofiles[i]);
+			continue;
+		}
+		if (0 == xine_open(alert_streams[i], audiofiles[i])) {
+			fprintf(stderr, "Warning: unable to open %s\n", audiofiles[i]);
+			xine_dispose(alert_streams[i]);
+			alert_streams[i] = NULL;
+		}
+	}
+}
+
+/* xine is brought up lazily: many units never play an alert. */
+pthread_once_t alert_once = PTHREAD_ONCE_INIT;
+
+void alert_ensure(void)
+{
+	assert(0 == pthread_once(&alert_once, alert_init));
+}
+
+/* Auxiliar function. Play the sound for an alert type. Worker thread only. */
+void emit_sound(alert_type alert)
+{
+	xine_stream_t *stream;
+
+	alert_ensure();
+
+	/* select proper pre-opened stream */
+	assert(alert >= ALERT_LOWBAT && alert <= ALERT_STOPSHUTDOWN);
+	stream = alert_streams[alert];
+	if (NULL == stream) {
+		fprintf(stderr, "Warning: unable to play alert sound\n");
+		return;
+	}
+
+	/* restart playback on the persistent pipeline */
+	xine_stop(stream);
+	if (0 == xine_play(stream, 0, 0))
+		fprintf(stderr, "Warning: unable to play alert sound\n");
+}
+
+void emit_alert(alert_type al)
+{
+	struct async_command cmd;
+
+	cmd.type = CMD_ALERT;
+	cmd.alert = al;
+	async_dispatch(&cmd);
+}
+
+/*
+ * Command ring feeding the asynchronous worker thread. The main loop is the
+ * only producer and the worker the only consumer, so a store fence between
+ * writing the slot and publishing the new head index is all the
+ * synchronization the ring needs. The semaphore just wakes the worker.
+ */
+#define CMD_RING_SIZE		64 /* entries, power of two */
+
+struct async_command cmd_ring[CMD_RING_SIZE];
+volatile unsigned cmd_ring_head = 0;	/* written by the producer only */
+volatile unsigned cmd_ring_tail = 0;	/* written by the worker only */
+sem_t cmd_ring_sem;
+
+void async_dispatch(const struct async_command *cmd)
+{
+	unsigned head = cmd_ring_head;
+
+	/* a full ring means the worker stalled for a very long time */
+	if (head - cmd_ring_tail >= CMD_RING_SIZE) {
+		fprintf(stderr, "Warning: command ring full, command dropped\n");
+		return;
+	}
+
+	cmd_ring[head % CMD_RING_SIZE] = *cmd;
+	__sync_synchronize();	/* publish the slot before the head index */
+	cmd_ring_head = head + 1;
+	assert(0 == sem_post(&cmd_ring_sem));
+}
+
+/* Worker thread routine. Consumes queued alert and sign commands. */
+void *async_worker_routine(void *unused)
+{
+	struct async_command cmd;
+
+	for (;;) {
+		while (-1 == sem_wait(&cmd_ring_sem))
+			assert(EINTR == errno);
+
+		assert(cmd_ring_tail != cmd_ring_head);
+		cmd = cmd_ring[cmd_ring_tail % CMD_RING_SIZE];
+		__sync_synchronize();	/* consume the slot before freeing it */
+		cmd_ring_tail = cmd_ring_tail + 1;
+
+		switch (cmd.type) {
+		case CMD_ALERT:
+			emit_sound(cmd.alert);
+			break;
+		default:
+			assert(false);	/* internal error !!! */
+			break;
+		}
+	}
+
+	return NULL; /* unreachable */
+}
+
+void async_init(void)
+{
+	pthread_t worker_thread;
+
+	assert(0 == sem_init(&cmd_ring_sem, 0, 0));
+	assert(0 == pthread_create_dt(&worker_thread, async_worker_routine, NULL));
+}
+
+/*
+ * Spawn engine. Both shutdown argv vectors are built once at parse_args()
+ * time, so launching or cancelling a shutdown is a single posix_spawn()
+ * from the caller: no thread creation, no shell, and no fork of the whole
+ * X11- and xine-loaded process, which has failed under memory pressure on
+ * small fleet units. Children are reaped from the main select loop when
+ * SIGCHLD tickles the self-pipe.
+ */
+#define SPAWN_ARGV_MAX		16
+
+extern char **environ;
+
+char *shutdown_start_argv[SPAWN_ARGV_MAX];
+char *shutdown_stop_argv[SPAWN_ARGV_MAX];
+char shutdown_wait_arg[8];	/* "+" plus SHUTDOWN_WAIT */
+int sigchld_pipe[2] = { -1, -1 };
+
+/* Auxiliar function. Split the shutdown command and append one argument. */
+void build_shutdown_argv(char *argvec[], const char extra1[], const char extra2[])
+{
+	char *copy;
+	char *tok;
+	int num = 0;
+
+	copy = strdup(arg_shutdown_command);
+	assert(NULL != copy);
+
+	/* copy is intentionally kept: the argv entries point into it */
+	for (tok = strtok(copy, " \t"); NULL != tok; tok = strtok(NULL, " \t")) {
+		assert(num < SPAWN_ARGV_MAX - 3);
+		argvec[num++] = tok;
 	}
-	xine_init(alert_engine);
+	assert(num > 0);
+
+	if (NULL != extra1)
+		argvec[num++] = (char *) extra1;
+	if (NULL != extra2)
+		argvec[num++] = (char *) extra2;
+	argvec[num] = NULL;
+}
+
+/* Auxiliar function. SIGCHLD handler, only tickles the self-pipe. */
+void sigchld_handler(int unused)
+{
+	char byte = 0;
+	ssize_t retval;
+
+	retval = write(sigchld_pipe[WRITE_FD], &byte, sizeof(char));
+	(void) retval;	/* a full pipe still means a pending wakeup */
 }
 
-/* Auxiliar thread to play sounds according to alert type. */
-void *emit_sound_routine(void *al)
+void spawn_init(void)
 {
-	xine_audio_port_t *alert_audioport = NULL;
-	xine_stream_t *alert_stream = NULL;
-	xine_event_queue_t *alert_eventqueue = NULL;
-	xine_event_t *alert_event = NULL;
+	struct sigaction sa;
+
+	assert(0 == pipe(sigchld_pipe));
+	assert(-1 != fcntl(sigchld_pipe[READ_FD], F_SETFL, O_NONBLOCK));
+	assert(-1 != fcntl(sigchld_pipe[WRITE_FD], F_SETFL, O_NONBLOCK));
+	sleep_watch_fd(sigchld_pipe[READ_FD]);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigchld_handler;
+	assert(0 == sigemptyset(&sa.sa_mask));
+	sa.sa_flags = SA_RESTART;
+	assert(0 == sigaction(SIGCHLD, &sa, NULL));
+}
 
-	const char *audiofile = NULL;
-	alert_type alert;
+/* Auxiliar function. Reap finished children after a SIGCHLD wakeup. */
+void spawn_reap(void)
+{
+	char buf[LINE_BUFSIZE];
 
-	/* recover alert type and free it */
-	assert(NULL != al);
-	alert = *((alert_type *)al);
-	free(al);
+	while (read(sigchld_pipe[READ_FD], buf, sizeof(buf)) > 0)
+		;
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		;
+}
 
-	/* select proper sound */
-	switch (alert) {
-	case ALERT_LOWBAT:
-		audiofile = arg_soundfile_lowbat;
-		break;
-	case ALERT_STARTSHUTDOWN:
-		audiofile = arg_soundfile_startsd;
-		break;
-	case ALERT_STOPSHUTDOWN:
-		audiofile = arg_soundfile_stopsd;
-		break;
-	default:
-		assert(false);	/* internal error !!! */
-		break;
-	}
+void start_shutdown(bool *already_active)
+{
+	pid_t pid;
 
-	/* initialize audio */
-	alert_audioport = xine_open_audio_driver(alert_engine, NULL, NULL);
-	if (alert_audioport == NULL)
-		goto error_exit;
+	if (*already_active)
+		return;
+
+	if (0 != posix_spawn(&pid, shutdown_start_argv[0], NULL, NULL, shutdown_start_argv, environ))
+		fprintf(stderr, "Warning: unable to launch shutdown\n");
+	*already_active = true;
+	emit_alert(ALERT_STARTSHUTDOWN);
+}
+
+void stop_shutdown(bool *still_active)
+{
+	pid_t pid;
+
+	if (! *still_active)
+		return;
+
+	if (0 != posix_spawn(&pid, shutdown_stop_argv[0], NULL, NULL, shutdown_stop_argv, environ))
+		fprintf(stderr, "Warning: unable to stop shutdown\n");
+	*still_active = false;
+	emit_alert(ALERT_STOPSHUTDOWN);
+}
 
-	alert_stream = xine_stream_new(alert_engine, alert_audioport, NULL);
-	if (alert_stream == NULL)
-		goto error_exit;
+/* Event engine global variables. */
+int acpi_event_fd = -1;		/* netlink uevent socket, -1 when polling */
 
-	alert_eventqueue = xine_event_new_queue(alert_stream);
-	if (alert_eventqueue == NULL)
-		goto error_exit;
+void acpi_events_init(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
 
-	/* play it */
-	assert(audiofile != NULL);
-	if (0 == xine_open(alert_stream, audiofile)) {
-		fprintf(stderr, "Warning: unable to open %s\n", audiofile);
-		goto clean_exit;
+	fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+	if (-1 == fd) {
+		fprintf(stderr, "Warning: no kernel event socket, using polling\n");
+		return;
 	}
-	if (0 == xine_play(alert_stream, 0, 0)) {
-		fprintf(stderr, "Warning: unable to play %s\n", audiofile);
-		goto clean_exit;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_pid = getpid();
+	addr.nl_groups = 1;
+
+	if (-1 == bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "Warning: unable to bind event socket, using polling\n");
+		assert(0 == close(fd));
+		return;
 	}
+
+	assert(-1 != fcntl(fd, F_SETFL, O_NONBLOCK));
+	acpi_event_fd = fd;
+	sleep_watch_fd(acpi_event_fd);
+}
+
+/* Auxiliar function. Drain queued uevents. True if any affects a battery. */
+bool acpi_events_drain(void)
+{
+	char buf[UEVENT_BUFSIZE];
+	ssize_t len;
+	ssize_t pos;
+	bool relevant = false;
+
 	for (;;) {
-		alert_event = xine_event_wait(alert_eventqueue);
-		if (alert_event->type == XINE_EVENT_UI_PLAYBACK_FINISHED)
-			break;
-		xine_event_free(alert_event);
+		len = recv(acpi_event_fd, buf, sizeof(buf) - 1, 0);
+		if (-1 == len) {
+			if (errno == EINTR)
+				continue;
+			break;	/* queue empty */
+		}
+		buf[len] = '\0';
+
+		/* payload is a series of null-terminated "key=value" strings */
+		for (pos = 0; pos < len; pos += strlen(buf + pos) + 1)
+			if (NULL != strstr(buf + pos, "power_supply"))
+				relevant = true;
 	}
-	if (alert_event != NULL) {
-		xine_event_free(alert_event);
-		alert_event = NULL;
+
+	return relevant;
+}
+
+/*
+ * Hot-path instrumentation. Each main loop phase (acquire, decide, publish,
+ * sleep) is timed with the monotonic clock and aggregated into preallocated
+ * log2-bucket histograms, so a probe is one clock read and two increments
+ * and can stay enabled in production. SIGUSR1 requests a dump to stderr at
+ * the end of the current cycle.
+ */
+#define STATS_NUM_BUCKETS	32
+
+const char *stats_phase_names[STATS_NUM_PHASES] = {
+	"acquire",
+	"decide",
+	"publish",
+	"sleep"
+};
+
+struct phase_stats {
+	unsigned long buckets[STATS_NUM_BUCKETS];
+	unsigned long count;
+	unsigned long long total_ns;
+};
+
+struct phase_stats stats[STATS_NUM_PHASES];
+
+long long stats_now_ns(void)
+{
+	struct timespec ts;
+
+	assert(0 == clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long stats_probe(stats_phase phase, long long phase_start)
+{
+	long long now = stats_now_ns();
+	unsigned long long elapsed;
+	int bucket = 0;
+
+	elapsed = (now > phase_start)? (unsigned long long) (now - phase_start) : 0;
+	stats[phase].count++;
+	stats[phase].total_ns += elapsed;
+
+	while (elapsed > 1 && bucket < STATS_NUM_BUCKETS - 1) {
+		elapsed >>= 1;
+		bucket++;
 	}
-	goto clean_exit;
+	stats[phase].buckets[bucket]++;
 
-error_exit:
-	fprintf(stderr, "Warning: unable to play alert sound\n");
-clean_exit:
-	if (alert_eventqueue != NULL)
-		xine_event_dispose_queue(alert_eventqueue);
-	if (alert_stream != NULL)
-		xine_dispose(alert_stream);
-	if (alert_audioport != NULL)
-		xine_close_audio_driver(alert_engine, alert_audioport);
-	return NULL;
+	return now;
 }
 
-void emit_alert(alert_type al)
+/* Auxiliar function. SIGUSR1 handler, only raises the dump flag. */
+void stats_sigusr1_handler(int unused)
 {
-	pthread_t sound_thread;
-	alert_type *alert;
+	stats_dump_requested = 1;
+}
 
-	/* create thread parameter */
-	alert = (alert_type*)malloc(sizeof(alert_type));
-	assert(NULL != alert);
-	*alert = al;
+void stats_init(void)
+{
+	struct sigaction sa;
 
-	/* launch thread */
-	assert(0 == pthread_create_dt(&sound_thread, emit_sound_routine, (void *)alert));
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stats_sigusr1_handler;
+	assert(0 == sigemptyset(&sa.sa_mask));
+	sa.sa_flags = SA_RESTART;
+	assert(0 == sigaction(SIGUSR1, &sa, NULL));
 }
 
-/* Auxiliar thread to lauch shutdown process. */
-void *start_shutdown_routine(void *unused)
+void stats_dump(void)
 {
-	static const char launch_args[] = " -h +";
-	char *cmdline = NULL;
+	int phase;
+	int bucket;
 
-	/* create command line string */
-	cmdline = (char *) malloc((strlen(arg_shutdown_command) + strlen(launch_args) + strlen(SHUTDOWN_WAIT) + 1) * sizeof(char));
-	assert(NULL != cmdline);
-	strcpy(cmdline, arg_shutdown_command);
-	strcat(cmdline, launch_args);
-	strcat(cmdline, SHUTDOWN_WAIT);
+	fprintf(stderr, "Cycle phase timings (log2 ns buckets):\n");
+	for (phase = 0; phase < STATS_NUM_PHASES; phase++) {
+		if (0 == stats[phase].count)
+			continue;
+		fprintf(stderr, "  %s: %lu samples, avg %llu ns\n",
+			stats_phase_names[phase], stats[phase].count,
+			stats[phase].total_ns / stats[phase].count);
+		for (bucket = 0; bucket < STATS_NUM_BUCKETS; bucket++)
+			if (0 != stats[phase].buckets[bucket])
+				fprintf(stderr, "    < 2^%d ns: %lu\n",
+					bucket + 1, stats[phase].buckets[bucket]);
+	}
+}
 
-	/* launch it */
-	if (-1 == system(cmdline))
-		fprintf(stderr, "Warning: unable to launch shutdown\n");
+/*
+ * Adaptive scheduler. The configured check period is treated as the floor
+ * for urgent situations; calm states sleep for minutes and a discharging
+ * battery is checked geometrically more often as the remaining capacity
+ * approaches the low limit, so the warning cadence near the limit is
+ * exactly the configured period.
+ */
+long next_check_period(charging_state state)
+{
+	long period = arg_check_period;
+	long relaxed;
+	long tte;
+	int remcap;
+	int lowlimit;
+	int margin;
+
+	/* never sleep less often than the user asked, even when relaxed */
+	relaxed = (CHECK_PERIOD_RELAXED > arg_check_period)? CHECK_PERIOD_RELAXED : arg_check_period;
+
+	switch (state) {
+	case CHST_CHARGED:
+	case CHST_CHARGING:
+	case CHST_NO_BAT:
+		/* nothing urgent can happen until the next state change */
+		period = relaxed;
+		break;
+
+	case CHST_DISCHARGING:
+		/* the low-battery warning may be firing on the projected
+		 * time to empty while the capacity margin is still wide;
+		 * its safety-time accounting counts each warning as one
+		 * configured period, so never stretch the period then */
+		tte = prediction_time_to_empty();
+		if (-1 != tte && tte <= cfg_tte_warning_time)
+			break;
+
+		lowlimit = get_design_capacity_low();
+		remcap = get_remaining_capacity();
+		if (-1 == lowlimit || -1 == remcap || lowlimit <= 0)
+			break;
 
-	/* destroy it and finish */
-	free(cmdline);
-	return NULL;
+		/* double the period per doubling of the margin over the limit */
+		for (margin = remcap - lowlimit; margin >= lowlimit; margin /= 2)
+			period *= 2;
+		if (period > relaxed)
+			period = relaxed;
+		break;
+
+	default:
+		break;	/* read problems keep the configured period */
+	}
+
+	if (period > CHECK_PERIOD_MAX)
+		period = CHECK_PERIOD_MAX;
+	return period;
 }
 
-void start_shutdown(bool *already_active)
+/*
+ * Suspend/resume detection. CLOCK_BOOTTIME keeps counting across a suspend
+ * while CLOCK_MONOTONIC does not, so a growing gap between the two means
+ * the machine slept — possibly draining a large chunk of battery — and the
+ * relative select() timeout slept with it. The main loop thread samples the
+ * gap at every wakeup and forces an immediate re-check when it widens.
+ */
+#define RESUME_SLACK		2 /* seconds */
+
+/* set when a resume was detected, consumed by the main loop */
+bool resume_detected = false;
+
+long resume_gap(void)
 {
-	pthread_t shutdown_thread;
-	if (*already_active)
-		return;
-	assert(0 == pthread_create_dt(&shutdown_thread, start_shutdown_routine, NULL));
-	*already_active = true;
-	emit_alert(ALERT_STARTSHUTDOWN);
+#ifdef CLOCK_BOOTTIME
+	static long long last_delta = -1;	/* main loop thread only */
+
+	struct timespec boot;
+	struct timespec mono;
+	long long delta;
+	long long gap;
+
+	if (-1 == clock_gettime(CLOCK_BOOTTIME, &boot))
+		return 0;	/* kernel too old: no detection */
+	assert(0 == clock_gettime(CLOCK_MONOTONIC, &mono));
+
+	delta = ((long long) boot.tv_sec - mono.tv_sec) * 1000000000LL + (boot.tv_nsec - mono.tv_nsec);
+	if (-1 == last_delta) {
+		last_delta = delta;
+		return 0;
+	}
+
+	gap = delta - last_delta;
+	last_delta = delta;
+	return (long) (gap / 1000000000LL);
+#else
+	return 0;
+#endif
 }
 
-/* Auxiliar thread to stop shutdown process. */
-void *stop_shutdown_routine(void *unused)
+/*
+ * Optional configuration file. Thresholds can be tuned fleet-wide by pushing
+ * a new file; an inotify watch picks up the change without restarting the
+ * daemon. A missing file or an unknown key is not an error: the compiled-in
+ * defaults (or the command line, for the check period) stay in effect.
+ */
+const char CONFIG_FILE[] = "/etc/battery_monitor.conf";
+int config_fd = -1;	/* inotify fd, watched in safe_sleep() */
+int config_wd = -1;
+
+/* Auxiliar function. Applies one key/value pair from the config file. */
+void config_apply(const char key[], long value)
 {
-	static const char cancel_args[] = " -c";
-	char *cmdline = NULL;
+	if (0 == strcmp(key, "check_period")) {
+		if (value >= CHECK_PERIOD_MIN && value <= CHECK_PERIOD_MAX)
+			arg_check_period = (int) value;
+		else
+			fprintf(stderr, "Warning: config check_period out of range\n");
+	} else if (0 == strcmp(key, "safety_time"))
+		cfg_safety_time = (int) value;
+	else if (0 == strcmp(key, "temp_sign_time"))
+		cfg_temp_sign_time = (int) value;
+	else if (0 == strcmp(key, "tte_warning_time"))
+		cfg_tte_warning_time = (int) value;
+	else if (0 == strcmp(key, "fd_budget"))
+		cfg_fd_budget = (int) value;
+	else if (0 == strcmp(key, "rss_budget_kb"))
+		cfg_rss_budget_kb = (int) value;
+	else if (0 == strcmp(key, "thread_budget"))
+		cfg_thread_budget = (int) value;
+	else if (0 == strcmp(key, "trace"))
+		cfg_trace = (0 != value);
+	else
+		fprintf(stderr, "Warning: unknown config key \"%s\"\n", key);
+}
 
-	/* create command line string */
-	cmdline = (char *) malloc((strlen(arg_shutdown_command) + strlen(cancel_args) + 1) * sizeof(char));
-	assert(NULL != cmdline);
-	strcpy(cmdline, arg_shutdown_command);
-	strcat(cmdline, cancel_args);
+/* Auxiliar function. Reads the whole config file if present. */
+void config_load(void)
+{
+	FILE *conf;
+	char line[LINE_BUFSIZE];
+	char key[LINE_BUFSIZE];
+	long value;
 
-	/* launch it */
-	if (-1 == system(cmdline))
-		fprintf(stderr, "Warning: unable to stop shutdown\n");
+	conf = fopen(CONFIG_FILE, "r");
+	if (NULL == conf)
+		return;		/* optional file: defaults apply */
 
-	/* destroy it and finish */
-	free(cmdline);
-	return NULL;
+	while (NULL != fgets(line, sizeof(line), conf)) {
+		if ('#' == line[0] || '\n' == line[0])
+			continue;
+		if (2 == sscanf(line, " %80[a-z_] = %ld", key, &value))
+			config_apply(key, value);
+		else
+			fprintf(stderr, "Warning: malformed config line: %s", line);
+	}
+	assert(0 == fclose(conf));
 }
 
-void stop_shutdown(bool *still_active)
+/* Auxiliar function. (Re-)adds the watch; editors replace the file by
+ * rename, which silently kills the previous one. */
+void config_watch_arm(void)
 {
-	pthread_t shutdown_thread;
-	if (! *still_active)
+	if (-1 == config_fd)
 		return;
-	assert(0 == pthread_create_dt(&shutdown_thread, stop_shutdown_routine, NULL));
-	*still_active = false;
-	emit_alert(ALERT_STOPSHUTDOWN);
+	config_wd = inotify_add_watch(config_fd, CONFIG_FILE,
+				IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+	if (-1 == config_wd)
+		fprintf(stderr, "Warning: unable to watch config file\n");
+}
+
+void config_init(void)
+{
+	config_load();
+
+	config_fd = inotify_init();
+	if (-1 == config_fd) {
+		fprintf(stderr, "Warning: unable to init inotify, config reload disabled\n");
+		return;
+	}
+	assert(-1 != fcntl(config_fd, F_SETFL, O_NONBLOCK));
+	config_watch_arm();
+	sleep_watch_fd(config_fd);
+}
+
+void config_reload(void)
+{
+	char buf[INOTIFY_BUFSIZE];
+
+	/* drain every queued event; one reload covers them all */
+	while (read(config_fd, buf, sizeof(buf)) > 0)
+		;
+	config_watch_arm();
+	config_load();
+}
+
+/*
+ * Persistent sleep machinery. The wake pipe is created once at startup and
+ * shared by every safe_sleep() call, so sleeping costs no pipe creation or
+ * close syscalls per cycle and cannot die under fd pressure; writing one
+ * byte to it from anywhere ends the current sleep early. The fds the main
+ * loop listens on (wake pipe, netlink, query socket, SIGCHLD pipe, config
+ * watch) are registered once into a persistent epoll set when each
+ * subsystem comes up, so a sleep costs one epoll_wait() and no per-cycle
+ * fd-set rebuilds.
+ */
+int sleep_pipe[2] = { -1, -1 };
+int sleep_epoll_fd = -1;
+
+#define SLEEP_MAX_EVENTS	8 /* fds the main loop can wait on */
+
+void sleep_init(void)
+{
+	assert(0 == pipe(sleep_pipe));
+	assert(-1 != fcntl(sleep_pipe[READ_FD], F_SETFL, O_NONBLOCK));
+	assert(-1 != fcntl(sleep_pipe[WRITE_FD], F_SETFL, O_NONBLOCK));
+
+	sleep_epoll_fd = epoll_create(SLEEP_MAX_EVENTS);
+	assert(-1 != sleep_epoll_fd);
+	sleep_watch_fd(sleep_pipe[READ_FD]);
+}
+
+void sleep_watch_fd(int fd)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	assert(0 == epoll_ctl(sleep_epoll_fd, EPOLL_CTL_ADD, fd, &ev));
+}
+
+void sleep_interrupt(void)
+{
+	char byte = 0;
+	ssize_t retval;
+
+	retval = write(sleep_pipe[WRITE_FD], &byte, sizeof(char));
+	(void) retval;	/* a full pipe still means a pending wakeup */
 }
 
 void safe_sleep(long seconds)
 {
-	int fds[2];		/* for pipe() */
+	struct epoll_event events[SLEEP_MAX_EVENTS];
 	struct timeval sltv;	/* time to wait */
 	fd_set readfd;		/* set for select() */
+	char buf[LINE_BUFSIZE];
+	time_t deadline;
+	long remaining;
+	int nevents;
+	int retval;
+	int fd;
+	int i;
+	bool wake;
+
+	deadline = time(NULL) + seconds;
+
+	/* battery events and queries wake the main loop thread only;
+	 * secondary threads just wait on the shared wake pipe */
+	if (0 == pthread_equal(pthread_self(), mainloop_thread)) {
+		remaining = (long) (deadline - time(NULL));
+		if (remaining <= 0)
+			return;
+
+		FD_ZERO(&readfd);
+		FD_SET(sleep_pipe[READ_FD], &readfd);
+		sltv.tv_sec = remaining;
+		sltv.tv_usec = 0L;
+		retval = select(sleep_pipe[READ_FD] + 1, &readfd, NULL, NULL, &sltv);
+		if (retval > 0)
+			while (read(sleep_pipe[READ_FD], buf, sizeof(buf)) > 0)
+				;
+		return;
+	}
+
+	for (;;) {
+		remaining = (long) (deadline - time(NULL));
+		if (remaining <= 0)
+			break;
+
+		/* we may not sleep much if we catch a signal, but... */
+		nevents = epoll_wait(sleep_epoll_fd, events, SLEEP_MAX_EVENTS, (int) (remaining * 1000L));
+
+		/* coming back from suspend: re-check the battery right away */
+		if (resume_gap() >= RESUME_SLACK) {
+			resume_detected = true;
+			snapshot_timestamp = 0;	/* pre-suspend data is stale */
+			break;
+		}
+
+		if (nevents <= 0)
+			break;
+
+		wake = false;
+		for (i = 0; i < nevents; i++) {
+			fd = events[i].data.fd;
+
+			/* reap finished children without waking the main loop */
+			if (-1 != sigchld_pipe[READ_FD] && fd == sigchld_pipe[READ_FD])
+				spawn_reap();
+
+			/* config file changed: reload and recheck right away
+			 * so a shorter check period takes effect at once */
+			else if (-1 != config_fd && fd == config_fd) {
+				config_reload();
+				wake = true;
+			}
 
-	/* prepare data */
-	assert(0 == pipe(fds));
-	FD_ZERO(&readfd);
-	FD_SET(fds[0], &readfd);
-	sltv.tv_sec = seconds;
-	sltv.tv_usec = 0L;
+			/* answer queries without waking the main loop */
+			else if (-1 != query_fd && fd == query_fd)
+				query_handle();
 
-	/* we may not sleep much if we catch a signal, but... */
-	select(fds[0] + 1, &readfd, NULL, NULL, &sltv);
+			/* battery event: wake up early to recheck the state */
+			else if (-1 != acpi_event_fd && fd == acpi_event_fd) {
+				if (acpi_events_drain())
+					wake = true;
+			}
+
+			/* explicit interruption: drain the pipe and leave */
+			else if (fd == sleep_pipe[READ_FD]) {
+				while (read(sleep_pipe[READ_FD], buf, sizeof(buf)) > 0)
+					;
+				wake = true;
+			}
+		}
 
-	/* close file descriptors */
-	assert(0 == close(fds[0]));
-	assert(0 == close(fds[1]));
+		if (wake)
+			break;
+	}
 }
 
 void parse_args(int argc, char *argv[])
@@ -876,6 +2882,8 @@ void parse_args(int argc, char *argv[])
 		fprintf(stderr, "command is usually '/sbin/shutdown', but\n");
 		fprintf(stderr, "it is there so you can indicate something\n");
 		fprintf(stderr, "like '/usr/bin/sudo /sbin/shutdown'.\n\n");
+		fprintf(stderr, "Alternatively, run with --query for a\n");
+		fprintf(stderr, "one-shot machine-readable state report.\n\n");
 		exit(EXIT_FAILURE);
 	}
 
@@ -886,6 +2894,12 @@ void parse_args(int argc, char *argv[])
 	arg_win_font = argv[ARG_FONT];
 	arg_shutdown_command = argv[ARG_SDCOMMAND];
 
+	/* pre-build both shutdown argv vectors for the spawn engine */
+	assert(strlen(SHUTDOWN_WAIT) + 2 <= sizeof(shutdown_wait_arg));
+	sprintf(shutdown_wait_arg, "+%s", SHUTDOWN_WAIT);
+	build_shutdown_argv(shutdown_start_argv, "-h", shutdown_wait_arg);
+	build_shutdown_argv(shutdown_stop_argv, "-c", NULL);
+
 	/* parse check period time */
 	if (argc == ARG_NUM_MAX) {
 		begin = argv[ARG_CHECK_PERIOD];
@@ -902,3 +2916,299 @@ void parse_args(int argc, char *argv[])
 	else
 		arg_check_period = CHECK_PERIOD_DEFAULT;
 }
+
+
+
+/*
+ * BENCHMARK HARNESS
+ *
+ * Built with -DBATTERY_MONITOR_BENCH (the "bench" make target), this
+ * replaces main() with a harness that runs the snapshot parser and the
+ * decision logic against synthetic data files and reports ns/iteration
+ * and heap growth, so parsing or scheduling changes can be measured
+ * before fleet rollout. The soak mode replays a recorded history ring
+ * through the decision logic at accelerated time.
+ */
+#ifdef BATTERY_MONITOR_BENCH
+
+#define BENCH_DEFAULT_ITERATIONS	1000000L
+
+const char BENCH_INFO_FIXTURE[] =
+	"present:                 yes\n"
+	"design capacity:         4400 mAh\n"
+	"last full capacity:      4200 mAh\n"
+	"design capacity low:     250 mAh\n"
+	"design capacity warning: 300 mAh\n";
+
+const char BENCH_STATE_FIXTURE[] =
+	"present:                 yes\n"
+	"capacity state:          ok\n"
+	"charging state:          discharging\n"
+	"present rate:            1000 mA\n"
+	"remaining capacity:      3500 mAh\n"
+	"present voltage:         12000 mV\n";
+
+const char BENCH_INFO_PATH[] =	"/tmp/battery_monitor_bench.info";
+const char BENCH_STATE_PATH[] =	"/tmp/battery_monitor_bench.state";
+
+/* Auxiliar function. Write one synthetic data file. */
+void bench_write_fixture(const char path[], const char contents[])
+{
+	FILE *fixture = fopen(path, "w");
+
+	assert(NULL != fixture);
+	assert(strlen(contents) == fwrite(contents, 1, strlen(contents), fixture));
+	assert(0 == fclose(fixture));
+}
+
+/* Auxiliar function. Monotonic timestamp in nanoseconds. */
+long long bench_now_ns(void)
+{
+	struct timespec ts;
+
+	assert(0 == clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Auxiliar function. Side-effect free replica of the main loop decision
+ * switch; returns a checksum so the compiler cannot discard the work.
+ */
+long bench_decide(charging_state state, int *warnnum)
+{
+	long actions = 0;
+	int remcap;
+	int lowlimit;
+	long tte;
+
+	switch (state) {
+	case CHST_DISCHARGING:
+		lowlimit = get_design_capacity_low();
+		if (-1 == lowlimit) {
+			actions++;
+			break;
+		}
+		remcap = get_remaining_capacity();
+		if (-1 == remcap) {
+			actions++;
+			break;
+		}
+		tte = prediction_time_to_empty();
+		if (remcap < lowlimit || (-1 != tte && tte <= cfg_tte_warning_time)) {
+			if (*warnnum * arg_check_period >= cfg_safety_time)
+				actions++;	/* would start a shutdown */
+			else
+				(*warnnum)++;	/* would emit an alert */
+		}
+		break;
+	default:
+		*warnnum = 0;
+		break;
+	}
+
+	return actions;
+}
+
+/* Auxiliar function. Parse plus decide over synthetic files. */
+void bench_run(long iterations)
+{
+	charging_state state;
+	long long before;
+	long long elapsed;
+	void *heap_before;
+	long checksum = 0;
+	int warnnum = 0;
+	long i;
+
+	bench_write_fixture(BENCH_INFO_PATH, BENCH_INFO_FIXTURE);
+	bench_write_fixture(BENCH_STATE_PATH, BENCH_STATE_FIXTURE);
+
+	/* point the only battery at the fixtures */
+	strcpy(batteries[0].name, "BENCH");
+	strcpy(batteries[0].info_path, BENCH_INFO_PATH);
+	strcpy(batteries[0].state_path, BENCH_STATE_PATH);
+	num_batteries = 1;
+
+	heap_before = sbrk(0);
+	before = bench_now_ns();
+
+	for (i = 0; i < iterations; i++) {
+		snapshot_timestamp = 0;	/* force a full reparse */
+		state = get_charging_state();
+		prediction_update(state);
+		checksum += bench_decide(state, &warnnum);
+	}
+
+	elapsed = bench_now_ns() - before;
+
+	printf("parse+decide: %ld iterations, %lld ns/iteration, %ld heap bytes total (checksum %ld)\n",
+		iterations, elapsed / iterations,
+		(long) ((char *) sbrk(0) - (char *) heap_before), checksum);
+
+	assert(0 == unlink(BENCH_INFO_PATH));
+	assert(0 == unlink(BENCH_STATE_PATH));
+}
+
+/* Auxiliar function. Replay a recorded history ring at accelerated time. */
+void bench_soak(const char trace_path[], long passes)
+{
+	struct history_file trace;
+	struct history_entry *entry;
+	long long before;
+	long long elapsed;
+	long samples = 0;
+	long checksum = 0;
+	int warnnum = 0;
+	unsigned i;
+	long pass;
+	FILE *f;
+
+	f = fopen(trace_path, "r");
+	if (NULL == f) {
+		fprintf(stderr, "Error: unable to open trace %s\n", trace_path);
+		exit(EXIT_FAILURE);
+	}
+	if (1 != fread(&trace, sizeof(trace), 1, f) || HISTORY_MAGIC != trace.header.magic) {
+		fprintf(stderr, "Error: %s is not a history ring\n", trace_path);
+		exit(EXIT_FAILURE);
+	}
+	assert(0 == fclose(f));
+
+	num_batteries = 1;
+	before = bench_now_ns();
+
+	for (pass = 0; pass < passes; pass++) {
+		for (i = 0; i < trace.header.num_entries; i++) {
+			entry = &trace.entries[i];
+			if (0 == entry->timestamp)
+				continue;	/* slot never written */
+
+			/* feed the recorded sample straight into the snapshot */
+			batteries[0].snap.present = (CHST_NO_BAT != entry->state);
+			batteries[0].snap.state = (charging_state) entry->state;
+			batteries[0].snap.remcap = entry->remcap;
+			batteries[0].snap.rate = entry->rate;
+			batteries[0].snap.lowcap = 250;
+			snapshot_timestamp = time(NULL);
+
+			prediction_update((charging_state) entry->state);
+			checksum += bench_decide((charging_state) entry->state, &warnnum);
+			samples++;
+		}
+	}
+
+	elapsed = bench_now_ns() - before;
+	if (0 == samples) {
+		fprintf(stderr, "Error: trace %s holds no samples\n", trace_path);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("soak: %ld samples replayed, %lld ns/sample (checksum %ld)\n",
+		samples, elapsed / samples, checksum);
+}
+
+/*
+ * Auxiliar function. Deterministically replay a captured acquisition trace
+ * through the decision replica. The safety-time accounting of the live
+ * loop counts warnings in check periods, so the recorded timestamp gaps
+ * are fed back as the check period; with a positive speedup the replay
+ * paces itself at recorded-time / speedup instead of running flat out.
+ * Signs and alerts stay side-effect free in the replica, which doubles as
+ * the X11/audio stub.
+ */
+void bench_replay(const char trace_path[], long speedup)
+{
+	struct trace_record record;
+	long long before;
+	long long elapsed;
+	long first_timestamp = 0;
+	long prev_timestamp = 0;
+	long last_timestamp = 0;
+	long samples = 0;
+	long checksum = 0;
+	int warnnum = 0;
+	long gap;
+	FILE *f;
+
+	f = fopen(trace_path, "r");
+	if (NULL == f) {
+		fprintf(stderr, "Error: unable to open trace %s\n", trace_path);
+		exit(EXIT_FAILURE);
+	}
+
+	num_batteries = 1;
+	before = bench_now_ns();
+
+	while (1 == fread(&record, sizeof(record), 1, f)) {
+		if (0 == first_timestamp)
+			first_timestamp = record.timestamp;
+		gap = record.timestamp - prev_timestamp;
+		if (0 != prev_timestamp && gap > 0) {
+			arg_check_period = (int) gap;
+			if (speedup > 0)
+				usleep((useconds_t) (gap * 1000000L / speedup));
+		}
+		prev_timestamp = record.timestamp;
+		last_timestamp = record.timestamp;
+
+		/* feed the recorded acquisition straight into the snapshot */
+		batteries[0].snap.present = (CHST_NO_BAT != record.state);
+		batteries[0].snap.state = (charging_state) record.state;
+		batteries[0].snap.remcap = record.remcap;
+		batteries[0].snap.rate = record.rate;
+		batteries[0].snap.lowcap = record.lowcap;
+		snapshot_timestamp = time(NULL);
+
+		prediction_update((charging_state) record.state);
+		checksum += bench_decide((charging_state) record.state, &warnnum);
+		samples++;
+	}
+	assert(0 == fclose(f));
+
+	elapsed = bench_now_ns() - before;
+	if (0 == samples) {
+		fprintf(stderr, "Error: trace %s holds no samples\n", trace_path);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("replay: %ld samples covering %ld s replayed in %lld ms (checksum %ld)\n",
+		samples, last_timestamp - first_timestamp,
+		elapsed / 1000000LL, checksum);
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = BENCH_DEFAULT_ITERATIONS;
+
+	arg_check_period = CHECK_PERIOD_DEFAULT;
+
+	if (argc >= 2 && strcmp(argv[1], "-s") == 0) {
+		if (argc < 3) {
+			fprintf(stderr, "Usage: %s -s trace_file [passes]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		bench_soak(argv[2], (argc >= 4)? strtol(argv[3], NULL, 0) : 1L);
+		return EXIT_SUCCESS;
+	}
+
+	if (argc >= 2 && strcmp(argv[1], "-r") == 0) {
+		if (argc < 3) {
+			fprintf(stderr, "Usage: %s -r trace_file [speedup]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		bench_replay(argv[2], (argc >= 4)? strtol(argv[3], NULL, 0) : 0L);
+		return EXIT_SUCCESS;
+	}
+
+	if (argc >= 2)
+		iterations = strtol(argv[1], NULL, 0);
+	if (iterations <= 0) {
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	bench_run(iterations);
+	return EXIT_SUCCESS;
+}
+
+#endif /* BATTERY_MONITOR_BENCH */